@@ -0,0 +1,160 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libcpmfs.h"
+
+/* Reads every file of a disk image from several threads sharing the same
+ * mount, and prints the read throughput for each thread count. */
+
+static struct cpm_fs_attr otronafs = {
+	.cylinders = 40,
+	.heads = 2,
+	.sector_count = 10,
+	.sector_size = 512,
+	.block_size = 2048,
+	.max_dir_entries = 128,
+	.boot_cylinders = 3,
+	.fill_order = CPM_FILL_HCS,
+	.cache_sectors = 256,
+};
+
+struct bench_file {
+	char name[13];
+	uint8_t user;
+};
+
+struct bench {
+	struct cpm_fs *fs;
+	struct bench_file *files;
+	int file_count;
+	int rounds;
+};
+
+struct worker {
+	pthread_t thread;
+	struct bench *bench;
+	size_t bytes;
+	int status;
+};
+
+static void *read_files(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct bench *b = w->bench;
+	struct cpm_fs_file_handle *fh;
+	uint8_t buf[4096];
+	size_t n;
+
+	for (int r = 0; r < b->rounds && !w->status; ++r) {
+		for (int i = 0; i < b->file_count && !w->status; ++i) {
+			w->status = cpm_fs_open(b->fs,
+						b->files[i].name,
+						CPM_MODE_RDONLY,
+						b->files[i].user,
+						&fh);
+			if (w->status)
+				break;
+			do {
+				w->status = cpm_fs_read(
+					b->fs, fh, buf, sizeof(buf), &n);
+				w->bytes += n;
+			} while (!w->status && n);
+			cpm_fs_close(b->fs, fh);
+		}
+	}
+	return NULL;
+}
+
+static int list_files(struct bench *b)
+{
+	struct cpm_fs_file *file;
+	struct cpm_fs_dir *dirp;
+	int status;
+
+	if ((status = cpm_fs_opendir(b->fs, &dirp)))
+		return status;
+
+	cpm_fs_readdir(b->fs, dirp, &file);
+	while (file) {
+		b->files = realloc(b->files,
+				   (b->file_count + 1) * sizeof(*b->files));
+		if (!b->files)
+			return CPM_ERR_NOMEM;
+		strcpy(b->files[b->file_count].name, file->d_name);
+		b->files[b->file_count].user = file->d_user;
+		b->file_count++;
+		cpm_fs_readdir(b->fs, dirp, &file);
+	}
+	cpm_fs_closedir(b->fs, dirp);
+	return CPM_SUCCESS;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(struct bench *b, int threads)
+{
+	struct worker *workers = calloc(threads, sizeof(struct worker));
+	size_t bytes = 0;
+	int status = 0;
+	double start;
+
+	if (!workers)
+		return CPM_ERR_NOMEM;
+
+	start = now();
+	for (int i = 0; i < threads; ++i) {
+		workers[i].bench = b;
+		pthread_create(&workers[i].thread, NULL, read_files, &workers[i]);
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		bytes += workers[i].bytes;
+		if (workers[i].status)
+			status = workers[i].status;
+	}
+
+	printf("%2d threads: %8.1f MB/s\n",
+	       threads,
+	       bytes / (now() - start) / (1024 * 1024));
+	free(workers);
+	return status;
+}
+
+int main(int argc, const char *argv[])
+{
+	struct bench b = { 0 };
+	int status;
+
+	if (argc < 2) {
+		printf("usage: %s raw_file [rounds]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	b.rounds = (argc > 2) ? atoi(argv[2]) : 100;
+
+	status = cpm_fs_new_from_image(
+		argv[1], &otronafs, CPM_FS_IMAGE_RDONLY, &b.fs);
+	if (!status)
+		status = list_files(&b);
+
+	for (int threads = 1; !status && threads <= 8; threads *= 2)
+		status = run(&b, threads);
+
+	if (b.fs)
+		cpm_fs_destroy(b.fs);
+	free(b.files);
+	if (status != CPM_SUCCESS) {
+		fprintf(stderr, "libcpmfs: %s\n", cpm_fs_status_str(status));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -46,6 +46,10 @@ enum cpm_fs_status {
 	CPM_ERR_FILE_READ_ONLY,
 	/* Trying to rename a file to a name that already exists */
 	CPM_ERR_DESTINATION_EXISTS,
+	/* No directory entry left for a new file or extent */
+	CPM_ERR_DIRECTORY_FULL,
+	/* Cannot open or map the disk image given to cpm_fs_new_from_image */
+	CPM_ERR_IMAGE,
 };
 
 enum cpm_fs_mode {
@@ -63,6 +67,16 @@ enum cpm_fs_fill_order {
 	CPM_FILL_HCS = 1,
 };
 
+enum cpm_fs_alloc_policy {
+	/* Always use the lowest free block, like the CP/M BDOS. */
+	CPM_ALLOC_FIRST_FREE = 0,
+	/* Keep the blocks of a file physically close to limit seeks.
+	 * Use the block right after the previous one of the file when it's
+	 * free and on the same or next cylinder, otherwise use the start of
+	 * the largest free area of the disk. */
+	CPM_ALLOC_CONTIGUOUS = 1,
+};
+
 struct cpm_fs_attr {
 	/* Disk geometry */
 	uint32_t cylinders;
@@ -93,8 +107,38 @@ struct cpm_fs_attr {
 
 	/* Determines in which order the disk is filled */
 	uint32_t fill_order;
+
+	/* Library settings, they don't depend on the disk format. */
+
+	/* How blocks are chosen when writing, see cpm_fs_alloc_policy */
+	uint32_t alloc_policy;
+	/* Combination of CPM_FS_MOUNT_* flags */
+	uint32_t mount_flags;
+	/* Number of sectors kept in memory, 0 for
+	 * CPM_FS_DEFAULT_CACHE_SECTORS */
+	uint32_t cache_sectors;
+	/* Number of sectors read in advance when a file is read sequentially,
+	 * 0 to disable. Useful for backends with a high latency. */
+	uint32_t readahead_sectors;
+	/* Number of tracks kept in memory with track callbacks, 0 for
+	 * CPM_FS_DEFAULT_CACHE_TRACKS */
+	uint32_t cache_tracks;
+	/* Number of sector requests kept in flight by the io_uring image
+	 * backend, 0 for CPM_FS_DEFAULT_QUEUE_DEPTH */
+	uint32_t queue_depth;
 };
 
+#define CPM_FS_DEFAULT_CACHE_SECTORS 32
+#define CPM_FS_DEFAULT_CACHE_TRACKS 8
+#define CPM_FS_DEFAULT_QUEUE_DEPTH 32
+
+/* Only read the directory when mounting. Checking the directory and building
+ * the allocation vector are delayed until the first operation needing them:
+ * writing, deleting, getting the free space... This operation fails if the
+ * disk is invalid, with the same error cpm_fs_new would have returned.
+ * Makes listing and reading files cheaper. */
+#define CPM_FS_MOUNT_LAZY 0x1
+
 #define CPM_FS_FLAG_SYSTEM 0x1
 #define CPM_FS_FLAG_READONLY 0x2
 #define CPM_FS_FLAG_ARCHIVED 0x4
@@ -108,6 +152,37 @@ struct cpm_fs_file {
 	uint8_t d_flags;
 };
 
+/* Problem found in the directory by cpm_fs_check */
+struct cpm_fs_conflict {
+	/* CPM_ERR_BLOCK_OVERFLOW, CPM_ERR_FILE_DIR_OVERLAP or
+	 * CPM_ERR_FILE_OVERLAP */
+	enum cpm_fs_status type;
+	uint32_t block;
+	/* Directory entry pointing to the block, and its file */
+	uint32_t entry;
+	char name[13];
+	uint8_t user;
+	/* CPM_ERR_FILE_OVERLAP only, first entry found using the same block.
+	 * Set to UINT32_MAX otherwise. */
+	uint32_t other_entry;
+	char other_name[13];
+	uint8_t other_user;
+};
+
+struct cpm_fs_check_report {
+	/* What cpm_fs_new returns for this disk */
+	enum cpm_fs_status status;
+	/* Every conflicting block pointer, in directory order */
+	uint32_t count;
+	struct cpm_fs_conflict *conflicts;
+};
+
+struct cpm_fs_usage {
+	uint32_t files; /* Number of files */
+	uint32_t blocks; /* Allocated blocks, including partially used ones */
+	size_t bytes; /* Sum of file sizes, in bytes */
+};
+
 /* Returns 0 for success.
  * in_sector & out_sector should match the sector_size specified in cpm_fs_attr.
  * sector is the position from the index pulse, not the ID from the headers.
@@ -123,6 +198,51 @@ typedef int (*write_sector_cb)(void *userdata,
 			       uint32_t sector,
 			       uint8_t *in_sector);
 
+/* One sector of a vectored request */
+struct cpm_fs_sector_io {
+	uint32_t cylinder;
+	uint32_t head;
+	uint32_t sector;
+	uint8_t *buf; /* sector_size bytes */
+};
+
+/* Optional, same as above for count sectors at once. Typically used for
+ * whole blocks and the directory, so backends can merge consecutive sectors
+ * into a single access. Sectors are given in logical order, which is not
+ * the physical one with skewed formats. */
+typedef int (*read_sectors_cb)(void *userdata,
+			       struct cpm_fs_sector_io *io,
+			       uint32_t count);
+typedef int (*write_sectors_cb)(void *userdata,
+				const struct cpm_fs_sector_io *io,
+				uint32_t count);
+
+/* Optional, for backends working on whole tracks. Sectors are stored one
+ * after the other, by the sector number given to read_sector_cb. */
+typedef int (*read_track_cb)(void *userdata,
+			     uint32_t cylinder,
+			     uint32_t head,
+			     uint8_t *out_track);
+typedef int (*write_track_cb)(void *userdata,
+			      uint32_t cylinder,
+			      uint32_t head,
+			      uint8_t *in_track);
+
+/* Disk access callbacks. When a vectored callback is NULL, its single sector
+ * version is used instead. Write callbacks can be NULL for read-only use.
+ *
+ * With read_track, every read is served from a cache of recently used
+ * tracks. With write_track too, writes only modify cached tracks, which are
+ * written back on cpm_fs_sync or when evicted from the cache. */
+struct cpm_fs_io {
+	read_sector_cb read_sector;
+	write_sector_cb write_sector;
+	read_sectors_cb read_sectors;
+	write_sectors_cb write_sectors;
+	read_track_cb read_track;
+	write_track_cb write_track;
+};
+
 /* Opaque */
 struct cpm_fs;
 struct cpm_fs_dir;
@@ -131,6 +251,12 @@ struct cpm_fs_file_handle;
 /* Every function returns a cpm_fs_status value.
  * CPM_SUCCESS (0) on success, other positive values on error. */
 
+/* A mount can be shared between threads. Reads through handles opened with
+ * CPM_MODE_RDONLY, directory listing and attribute queries run concurrently,
+ * every other operation runs alone. Read callbacks may then be called from
+ * several threads at once. A handle must only be used by one thread at a
+ * time, except with cpm_fs_pread. */
+
 /* File names are case-sensitive. The CCP (command line interface) forces
  * upper case, so almost every file is in uppercase. However, some software
  * (MBASIC for instance) can create and modify lower case filenames. */
@@ -140,10 +266,46 @@ enum cpm_fs_status cpm_fs_new(struct cpm_fs_attr *attributes,
 			      write_sector_cb set_sector_cb,
 			      void *userdata,
 			      struct cpm_fs **out);
+/* Same as cpm_fs_new, with optional vectored callbacks */
+enum cpm_fs_status cpm_fs_new_io(struct cpm_fs_attr *attributes,
+				 const struct cpm_fs_io *io,
+				 void *userdata,
+				 struct cpm_fs **out);
+
+/* Image is opened read-only, writing fails with CPM_ERR_SECTOR_WRITE */
+#define CPM_FS_IMAGE_RDONLY 0x1
+/* Image stores every track of the first side, then the second side.
+ * By default, both sides of a cylinder are stored before the next one. */
+#define CPM_FS_IMAGE_SIDES 0x2
+/* Read and write the image with io_uring instead of mapping it, keeping up
+ * to queue_depth sector requests in flight. Useful for images on fast
+ * storage read by several threads. The image is mapped as usual when
+ * io_uring isn't available. */
+#define CPM_FS_IMAGE_URING 0x4
+
+/* Mount a raw disk image file, without callbacks. The image is mapped in
+ * memory: sectors are copied from and to the mapping, and cpm_fs_sync also
+ * flushes the mapping to the file. With CPM_FS_IMAGE_URING, sectors are
+ * read and written with io_uring instead and cpm_fs_sync calls fsync. */
+enum cpm_fs_status cpm_fs_new_from_image(const char *path,
+					 struct cpm_fs_attr *attributes,
+					 uint32_t flags,
+					 struct cpm_fs **out);
 enum cpm_fs_status cpm_fs_destroy(struct cpm_fs *fs);
 
-/* Write superblock (file allocation table) to disk. This should be called
- * when done with creating and writing files, to log changes to the disk. */
+/* Read and check the directory without mounting the disk. Unlike cpm_fs_new,
+ * which stops at the first error, every conflict is listed in the report.
+ * Returns CPM_SUCCESS if the check could be done, even when the disk is
+ * invalid. Free the report with cpm_fs_free_check_report. */
+enum cpm_fs_status cpm_fs_check(struct cpm_fs_attr *attributes,
+				read_sector_cb get_sector_cb,
+				void *userdata,
+				struct cpm_fs_check_report **out_report);
+enum cpm_fs_status cpm_fs_free_check_report(struct cpm_fs_check_report *report);
+
+/* Write buffered file data, the superblock (file allocation table) and
+ * modified tracks to disk. This should be called when done with creating and
+ * writing files, to log changes to the disk. */
 enum cpm_fs_status cpm_fs_sync(struct cpm_fs *fs);
 
 /* Directory, no name argument needed as there are no subdirectories */
@@ -172,12 +334,158 @@ enum cpm_fs_status cpm_fs_read(struct cpm_fs *fs,
 			       size_t count,
 			       size_t *out_read);
 
+/* Writes are buffered per handle, data reaches the disk when a block is
+ * full, on cpm_fs_close or on cpm_fs_sync. */
 enum cpm_fs_status cpm_fs_write(struct cpm_fs *fs,
 				struct cpm_fs_file_handle *file,
 				uint8_t *buf,
 				size_t count,
 				size_t *out_written);
 
+/* Same as cpm_fs_read and cpm_fs_write at the given offset, without using
+ * or moving the position of the handle. cpm_fs_pwrite writes data to disk
+ * before returning, and fills the gap with zeros when offset is past the
+ * end of the file. */
+enum cpm_fs_status cpm_fs_pread(struct cpm_fs *fs,
+				struct cpm_fs_file_handle *file,
+				uint8_t *buf,
+				size_t count,
+				size_t offset,
+				size_t *out_read);
+enum cpm_fs_status cpm_fs_pwrite(struct cpm_fs *fs,
+				 struct cpm_fs_file_handle *file,
+				 uint8_t *buf,
+				 size_t count,
+				 size_t offset,
+				 size_t *out_written);
+
+/* Move the position of an opened file, whence is SEEK_SET, SEEK_CUR or
+ * SEEK_END from stdio.h. The new position is written to out_pos unless it's
+ * NULL. Positioning past the end is allowed: reads there return nothing,
+ * and writes first fill the gap with zeros. */
+enum cpm_fs_status cpm_fs_seek(struct cpm_fs *fs,
+			       struct cpm_fs_file_handle *file,
+			       int64_t offset,
+			       int whence,
+			       size_t *out_pos);
+enum cpm_fs_status cpm_fs_tell(struct cpm_fs *fs,
+			       struct cpm_fs_file_handle *file,
+			       size_t *out_pos);
+
+/* Asynchronous reads and writes. Requests are run by a pool of worker
+ * threads with cpm_fs_pread and cpm_fs_pwrite, so several of them are in
+ * flight at once: pair this with CPM_FS_IMAGE_URING or thread-safe read
+ * callbacks. Buffers must stay valid until the request completes. */
+struct cpm_fs_aio;
+
+/* Called by cpm_fs_aio_poll with the status and the number of bytes read
+ * or written by the request */
+typedef void (*cpm_fs_aio_cb)(void *userdata,
+			      enum cpm_fs_status status,
+			      size_t count);
+
+#define CPM_FS_DEFAULT_AIO_WORKERS 4
+
+/* Start worker threads, 0 for CPM_FS_DEFAULT_AIO_WORKERS. Destroy the
+ * engine before destroying fs or closing handles it still uses. */
+enum cpm_fs_status
+cpm_fs_aio_new(struct cpm_fs *fs, uint32_t workers, struct cpm_fs_aio **out);
+/* Waits for every submitted request, and calls their callbacks */
+enum cpm_fs_status cpm_fs_aio_destroy(struct cpm_fs_aio *aio);
+
+/* Queue a request and return immediately. The callback can be NULL. */
+enum cpm_fs_status cpm_fs_read_async(struct cpm_fs_aio *aio,
+				     struct cpm_fs_file_handle *file,
+				     uint8_t *buf,
+				     size_t count,
+				     size_t offset,
+				     cpm_fs_aio_cb cb,
+				     void *userdata);
+enum cpm_fs_status cpm_fs_write_async(struct cpm_fs_aio *aio,
+				      struct cpm_fs_file_handle *file,
+				      uint8_t *buf,
+				      size_t count,
+				      size_t offset,
+				      cpm_fs_aio_cb cb,
+				      void *userdata);
+
+/* Call the callbacks of completed requests, in the calling thread. Waits
+ * until at least min_complete requests completed, or none is left in
+ * flight. The number of callbacks called is written to out_count unless
+ * it's NULL. */
+enum cpm_fs_status cpm_fs_aio_poll(struct cpm_fs_aio *aio,
+				   uint32_t min_complete,
+				   uint32_t *out_count);
+
+/* Receives the whole contents of one file during cpm_fs_extract_all, size
+ * bytes in data. data is only valid during the call, and may be NULL when
+ * size is 0. Returning anything but CPM_SUCCESS stops the extraction, and is
+ * returned by cpm_fs_extract_all. */
+typedef enum cpm_fs_status (*cpm_fs_sink_cb)(void *userdata,
+					     const struct cpm_fs_file *file,
+					     const uint8_t *data,
+					     size_t size);
+
+/* Read every file of the disk and give each one to sink. The directory is
+ * scanned once to plan every file, then files are handed out in directory
+ * order to worker threads, the calling thread included. Several sinks can
+ * run at once from different threads, sinks must not use fs. Other threads
+ * can only read fs during the extraction. */
+enum cpm_fs_status cpm_fs_extract_all(struct cpm_fs *fs,
+				      uint32_t workers,
+				      cpm_fs_sink_cb sink,
+				      void *userdata);
+
+/* Receives the next size bytes of a stream. Returning anything but
+ * CPM_SUCCESS stops the export, and is returned by the caller. */
+typedef enum cpm_fs_status (*cpm_fs_stream_cb)(void *userdata,
+					       const uint8_t *data,
+					       size_t size);
+
+#define CPM_FS_DEFAULT_TAR_BUFFER (1024 * 1024)
+
+/* Write every file of the disk as a POSIX tar archive, USER/NAME.EXT for
+ * each file. Read-only files have mode 0444, and file attributes are also
+ * kept in a PAX header as LIBCPMFS.flags, with letters R, S and A.
+ * Allocated blocks are read once, in physical order, and files are written
+ * as soon as they're complete: the archive isn't in directory order. Blocks
+ * read before their file can be written are kept in memory, up to
+ * max_buffer bytes (0 for CPM_FS_DEFAULT_TAR_BUFFER). Past that, they're
+ * read again when their file is written. */
+enum cpm_fs_status cpm_fs_export_tar(struct cpm_fs *fs,
+				     size_t max_buffer,
+				     cpm_fs_stream_cb sink,
+				     void *userdata);
+
+/* Fills buf with the next count bytes of a file given to cpm_fs_import.
+ * Returning anything but CPM_SUCCESS stops the import, and is returned by
+ * cpm_fs_import. */
+typedef enum cpm_fs_status (*cpm_fs_source_cb)(void *userdata,
+					       uint8_t *buf,
+					       size_t count);
+
+/* A new file for cpm_fs_import. Contents are size bytes from data, or from
+ * read when data is NULL. */
+struct cpm_fs_import_file {
+	const char *name;
+	int user;
+	size_t size;
+	const uint8_t *data;
+	cpm_fs_source_cb read;
+	void *userdata;
+};
+
+/* Create several new files at once and write them to disk, then write the
+ * directory once like cpm_fs_sync. Directory entries and blocks for every
+ * file are reserved before writing anything, each file in a single run of
+ * free blocks when possible. Fails without changing the disk when the
+ * directory or the disk are too small, or when a file already exists. On
+ * other errors the files are removed, but their blocks may have been
+ * written. */
+enum cpm_fs_status cpm_fs_import(struct cpm_fs *fs,
+				 const struct cpm_fs_import_file *files,
+				 uint32_t count);
+
 /* Attributes */
 enum cpm_fs_status cpm_fs_getattr(struct cpm_fs *fs,
 				  struct cpm_fs_file_handle *file,
@@ -201,6 +509,19 @@ enum cpm_fs_status cpm_fs_rename(struct cpm_fs *fs,
 enum cpm_fs_status cpm_fs_get_available_space(struct cpm_fs *fs,
 					      size_t *out_space);
 
+/* Get space used by each user area, out_users must hold 16 values.
+ * Available space in bytes is also written to out_free.
+ * Totals are kept up to date in memory, this doesn't scan the directory. */
+enum cpm_fs_status cpm_fs_get_usage(struct cpm_fs *fs,
+				    struct cpm_fs_usage *out_users,
+				    size_t *out_free);
+
+/* Get space used by the given file, files is set to 1. */
+enum cpm_fs_status cpm_fs_get_file_usage(struct cpm_fs *fs,
+					 const char *pathname,
+					 int user,
+					 struct cpm_fs_usage *out);
+
 /* Error code to printable string */
 const char *cpm_fs_status_str(enum cpm_fs_status status);
 
@@ -1,35 +1,74 @@
 /* Copyright (c) 2025 Arthur DAUZAT
  * SPDX-License-Identifier: BSD-3-Clause */
 
+#include <stdio.h>
 #include <string.h>
 
 #include "cpmfs_internal.h"
 
-static int write_superblock(struct cpm_fs *fs)
+void fs_lock_shared(struct cpm_fs *fs)
 {
-	uint32_t i, j;
-	uint32_t c, h, s;
-	/* Number of entries per sector */
-	uint32_t entries_c = fs->attr.sector_size / sizeof(cpm_entry);
-	int ret;
+	pthread_rwlock_rdlock(&fs->lock);
+}
 
-	block_to_chs(fs, 0, 0, &c, &h, &s);
-	i = 0;
-	while (i < fs->superblock.count) {
-		memset(fs->cache, 0xE5, fs->attr.sector_size);
-		for (j = 0; j < entries_c && i + j < fs->superblock.count; ++j)
-			memcpy(fs->cache + j * sizeof(cpm_entry),
-			       &fs->superblock.entries[i + j],
-			       sizeof(cpm_entry));
+void fs_lock(struct cpm_fs *fs)
+{
+	pthread_rwlock_wrlock(&fs->lock);
+}
 
-		ret = fs->write_sector(fs->userdata, c, h, s, fs->cache);
-		if (ret)
-			return CPM_ERR_SECTOR_WRITE;
+void fs_lock_handle(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	if (fh->mode == CPM_MODE_RDONLY)
+		fs_lock_shared(fs);
+	else
+		fs_lock(fs);
+}
+
+void fs_unlock(struct cpm_fs *fs)
+{
+	pthread_rwlock_unlock(&fs->lock);
+}
+
+static int sector_io_cmp(const void *a, const void *b)
+{
+	const struct cpm_fs_sector_io *x = (const struct cpm_fs_sector_io *)a;
+	const struct cpm_fs_sector_io *y = (const struct cpm_fs_sector_io *)b;
+
+	if (x->cylinder != y->cylinder)
+		return (x->cylinder > y->cylinder) ? 1 : -1;
+	if (x->head != y->head)
+		return (x->head > y->head) ? 1 : -1;
+	if (x->sector != y->sector)
+		return (x->sector > y->sector) ? 1 : -1;
+	return 0;
+}
 
-		i += j;
-		block_to_chs(fs, 0, (i * sizeof(cpm_entry)), &c, &h, &s);
+/* Write modified directory sectors, in physical order */
+static int write_superblock(struct cpm_fs *fs)
+{
+	struct cpm_superblock *sb = &fs->superblock;
+	struct cpm_fs_sector_io *io = fs->iov;
+	uint32_t i, n = 0;
+	int ret;
+
+	/* Entries are stored sector by sector, write them in place */
+	for (i = bitmap_find_set(sb->dirty, sb->sectors, 0); i != CPM_NO_ENTRY;
+	     i = bitmap_find_set(sb->dirty, sb->sectors, i + 1)) {
+		block_to_chs(fs,
+			     0,
+			     i * fs->attr.sector_size,
+			     &io[n].cylinder,
+			     &io[n].head,
+			     &io[n].sector);
+		io[n].buf = (uint8_t *)sb->entries + i * fs->attr.sector_size;
+		n++;
 	}
+	qsort(io, n, sizeof(struct cpm_fs_sector_io), sector_io_cmp);
 
+	if ((ret = disk_write(fs, io, n)))
+		return ret;
+
+	memset(sb->dirty, 0, BITMAP_WORDS(sb->sectors) * sizeof(uint64_t));
 	return CPM_SUCCESS;
 }
 
@@ -48,21 +87,91 @@ enum cpm_fs_status cpm_fs_opendir(struct cpm_fs *fs,
 	return CPM_SUCCESS;
 }
 
-enum cpm_fs_status cpm_fs_open(struct cpm_fs *fs,
-			       const char *pathname,
-			       enum cpm_fs_mode mode,
-			       int user,
-			       struct cpm_fs_file_handle **out_file)
+static int map_push_entry(struct cpm_fs_file_handle *fh, uint32_t entry)
 {
-	int entry;
+	uint32_t *tmp;
+
+	if (fh->entry_count == fh->entry_cap) {
+		fh->entry_cap = fh->entry_cap ? fh->entry_cap * 2 : 4;
+		tmp = (uint32_t *)realloc(fh->entries,
+					  fh->entry_cap * sizeof(uint32_t));
+		if (!tmp)
+			return CPM_ERR_NOMEM;
+		fh->entries = tmp;
+	}
+	fh->entries[fh->entry_count++] = entry;
+	return 0;
+}
+
+static int map_push_block(struct cpm_fs_file_handle *fh, uint16_t block)
+{
+	uint16_t *tmp;
+
+	if (fh->block_count == fh->block_cap) {
+		fh->block_cap = fh->block_cap ? fh->block_cap * 2 : 16;
+		tmp = (uint16_t *)realloc(fh->blocks,
+					  fh->block_cap * sizeof(uint16_t));
+		if (!tmp)
+			return CPM_ERR_NOMEM;
+		fh->blocks = tmp;
+	}
+	fh->blocks[fh->block_count++] = block;
+	return 0;
+}
+
+int build_block_map(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	uint8_t per_entry = max_blocks_per_entry(fs);
+	cpm_entry *entry = NULL;
+	uint32_t last = fh->entry;
+	uint16_t blocks[16];
+	uint8_t j = 0;
 	int ret;
 
-	if (!fs || !pathname || mode < CPM_MODE_RDONLY ||
-	    mode > CPM_MODE_RDWR || !out_file)
-		return CPM_ERR_INVALID_ARG;
+	for (uint32_t i = fh->entry; i != CPM_NO_ENTRY;
+	     i = get_next_extent(fs, i)) {
+		if ((ret = map_push_entry(fh, i)))
+			return ret;
 
-	if (!is_valid_user(user))
-		return CPM_ERR_INVALID_USER;
+		entry = &fs->superblock.entries[i];
+		last = i;
+		entry_get_blocks(fs, entry, blocks);
+		for (j = 0; j < per_entry && blocks[j]; ++j)
+			if ((ret = map_push_block(fh, blocks[j])))
+				return ret;
+		if (j < per_entry)
+			break;
+	}
+
+	/* Last block size is determined by RC */
+	fh->last_block_size = fs->attr.block_size;
+	if (fh->block_count && get_next_extent(fs, last) == CPM_NO_ENTRY &&
+	    (entry->rc * 128) % fs->attr.block_size != 0)
+		fh->last_block_size = (entry->rc * 128) % fs->attr.block_size;
+
+	return 0;
+}
+
+static void free_handle(struct cpm_fs_file_handle *fh)
+{
+	free(fh->blocks);
+	free(fh->entries);
+	free(fh->iov);
+	free(fh->wbuf);
+	free(fh);
+}
+
+static int open_file(struct cpm_fs *fs,
+		     const char *pathname,
+		     enum cpm_fs_mode mode,
+		     int user,
+		     struct cpm_fs_file_handle **out_file)
+{
+	int entry;
+	int ret;
+
+	if (mode != CPM_MODE_RDONLY && (ret = ensure_checked(fs)))
+		return ret;
 
 	entry = find_file(fs, pathname, user);
 	if (entry == -1) {
@@ -89,151 +198,557 @@ enum cpm_fs_status cpm_fs_open(struct cpm_fs *fs,
 	(*out_file)->block = 0;
 	(*out_file)->offset = 0;
 	(*out_file)->mode = mode;
+	(*out_file)->wbuf_block = CPM_NO_ENTRY;
+
+	(*out_file)->iov = (struct cpm_fs_sector_io *)calloc(
+		fs->iov_cap, sizeof(struct cpm_fs_sector_io));
+	ret = (*out_file)->iov ? build_block_map(fs, *out_file) :
+				 CPM_ERR_NOMEM;
+	if (ret) {
+		free_handle(*out_file);
+		*out_file = NULL;
+		return ret;
+	}
+	(*out_file)->fresh_from = (*out_file)->block_count;
+
+	pthread_mutex_lock(&fs->handles_lock);
+	(*out_file)->next = fs->handles;
+	if (fs->handles)
+		fs->handles->prev = *out_file;
+	fs->handles = *out_file;
+	pthread_mutex_unlock(&fs->handles_lock);
 
 	return CPM_SUCCESS;
 }
 
-enum cpm_fs_status cpm_fs_read(struct cpm_fs *fs,
-			       struct cpm_fs_file_handle *fh,
-			       uint8_t *buf,
-			       size_t count,
-			       size_t *out_read)
+enum cpm_fs_status cpm_fs_open(struct cpm_fs *fs,
+			       const char *pathname,
+			       enum cpm_fs_mode mode,
+			       int user,
+			       struct cpm_fs_file_handle **out_file)
 {
-	cpm_entry *entry;
-	uint16_t block;
-	uint32_t block_size;
-	uint32_t last_extent;
-	uint32_t c, h, s;
-	int ret = 0;
+	int ret;
 
-	if (!fs || !fh || !buf || count == 0 || !out_read)
+	if (!fs || !pathname || mode < CPM_MODE_RDONLY ||
+	    mode > CPM_MODE_RDWR || !out_file)
 		return CPM_ERR_INVALID_ARG;
 
-	*out_read = 0;
-	entry = &fs->superblock.entries[fh->entry];
-	last_extent = get_last_extent(fs, entry);
-	while (count) {
-		if (fs->block_addressing == CPM_BLOCK_ADDR_8)
-			block = entry->block_ptr[fh->block];
-		else
-			block = entry->block_ptr_w[fh->block];
+	if (!is_valid_user(user))
+		return CPM_ERR_INVALID_USER;
 
-		if (!block) /* EOF */
-			break;
+	/* Read-only opens don't modify the directory */
+	if (mode == CPM_MODE_RDONLY)
+		fs_lock_shared(fs);
+	else
+		fs_lock(fs);
+	ret = open_file(fs, pathname, mode, user, out_file);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
 
-		/* Last block size is determined by RC */
-		block_size = fs->attr.block_size;
-		if (extent_nb(entry) == last_extent &&
-		    is_last_block(fs, entry, fh->block) &&
-		    (entry->rc * 128) % fs->attr.block_size != 0)
-			block_size = (entry->rc * 128) % fs->attr.block_size;
-
-		/* Read sector into cache */
-		block_to_chs(fs, block, fh->offset, &c, &h, &s);
-		ret = fs->read_sector(fs->userdata, c, h, s, fs->cache);
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static size_t handle_size(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	if (!fh->block_count)
+		return 0;
+	return (size_t)(fh->block_count - 1) * fs->attr.block_size +
+	       fh->last_block_size;
+}
+
+static size_t handle_pos(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	return (size_t)fh->block * fs->attr.block_size + fh->offset;
+}
+
+static void set_handle_pos(struct cpm_fs *fs,
+			   struct cpm_fs_file_handle *fh,
+			   size_t pos)
+{
+	fh->block = (uint32_t)(pos / fs->attr.block_size);
+	fh->offset = (uint32_t)(pos % fs->attr.block_size);
+}
+
+/* Write count bytes at offset in a block. The part of a sector before
+ * offset is always kept, the part after the data only if keep_tail is set. */
+static ssize_t write_block(struct cpm_fs *fs,
+			   uint16_t block,
+			   uint32_t offset,
+			   uint8_t *buf,
+			   size_t count,
+			   bool keep_tail)
+{
+	uint32_t ss = fs->attr.sector_size;
+	uint32_t pos, len, sector_off, end;
+	uint32_t c, h, s;
+	uint32_t n = 0;
+	int ret;
+
+	end = offset + (uint32_t)MIN(count, fs->attr.block_size - offset);
+	for (pos = offset; pos < end; pos += len, buf += len) {
+		block_to_chs(fs, block, pos, &c, &h, &s);
+		sector_off = pos % ss;
+		len = MIN(ss - sector_off, end - pos);
+
+		if (len == ss) {
+			/* Whole sectors are written together */
+			fs->iov[n].cylinder = c;
+			fs->iov[n].head = h;
+			fs->iov[n].sector = s;
+			fs->iov[n].buf = buf;
+			n++;
+			continue;
+		}
+
+		ret = cache_write(fs,
+				  c,
+				  h,
+				  s,
+				  buf,
+				  sector_off,
+				  len,
+				  sector_off != 0 || keep_tail);
 		if (ret != 0)
-			return CPM_ERR_SECTOR_READ;
+			return -CPM_ERR_SECTOR_WRITE;
+	}
+
+	if (disk_write(fs, fs->iov, n))
+		return -CPM_ERR_SECTOR_WRITE;
+	return (ssize_t)(end - offset);
+}
 
-		uint32_t sector_offset = fh->offset % fs->attr.sector_size;
+/* Write the buffered data not on disk yet */
+static int flush_write_buffer(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	uint32_t ss = fs->attr.sector_size;
+	uint32_t start;
+	ssize_t ret;
+
+	if (fh->wbuf_block == CPM_NO_ENTRY || fh->wbuf_flushed == fh->wbuf_end)
+		return 0;
+
+	/* Start from the beginning of the sector when it's in the buffer, so
+	 * it doesn't have to be read back */
+	start = fh->wbuf_flushed - fh->wbuf_flushed % ss;
+	if (start < fh->wbuf_start)
+		start = fh->wbuf_flushed;
+
+	ret = write_block(fs,
+			  fh->blocks[fh->wbuf_block],
+			  start,
+			  fh->wbuf + start,
+			  fh->wbuf_end - start,
+			  fh->wbuf_block < fh->fresh_from);
+	if (ret < 0)
+		return (int)-ret;
+	fh->wbuf_flushed = fh->wbuf_end;
+	return 0;
+}
+
+/* Flush the write buffer before moving the cursor elsewhere, as it only
+ * holds one contiguous range */
+static int drop_write_buffer(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	int ret;
 
-		/* Compute size to read */
-		uint32_t size_to_read = fs->attr.sector_size;
-		if (block_size - fh->offset < fs->attr.sector_size)
-			size_to_read = block_size - fh->offset;
+	if ((ret = flush_write_buffer(fs, fh)))
+		return ret;
+	fh->wbuf_block = CPM_NO_ENTRY;
+	return 0;
+}
+
+int read_block(struct cpm_fs *fs,
+		      struct cpm_fs_sector_io *iov,
+		      uint16_t block,
+		      uint8_t *buf,
+		      uint32_t start,
+		      uint32_t end)
+{
+	uint32_t ss = fs->attr.sector_size;
+	uint32_t pos, len, sector_off;
+	uint32_t c, h, s;
+	uint32_t n = 0;
+	int ret;
+
+	for (pos = start; pos < end; pos += len, buf += len) {
+		block_to_chs(fs, block, pos, &c, &h, &s);
+		sector_off = pos % ss;
+		len = ss - sector_off;
+		if (end - pos < len)
+			len = end - pos;
+
+		if (len != ss) {
+			ret = cache_read_part(fs, c, h, s, buf, sector_off, len);
+			if (ret)
+				return ret;
+		} else if (!cache_copy(fs, c, h, s, buf)) {
+			iov[n].cylinder = c;
+			iov[n].head = h;
+			iov[n].sector = s;
+			iov[n].buf = buf;
+			n++;
+		}
+	}
+
+	return disk_read(fs, iov, n);
+}
+
+/* Load the sectors following a sequential read into the cache. Requests are
+ * made by half windows so the backend gets them in batches. */
+static int readahead(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	uint32_t ss = fs->attr.sector_size;
+	uint32_t per_block = fs->attr.block_size / ss;
+	uint32_t next, end, total, n = 0;
+
+	if (!fh->block_count)
+		return 0;
+
+	/* Current sector, and end of the file */
+	next = fh->block * per_block + fh->offset / ss;
+	total = (fh->block_count - 1) * per_block +
+		(fh->last_block_size + ss - 1) / ss;
+
+	if (fh->ra_end < next)
+		fh->ra_end = next;
+	if (fh->ra_end - next > fs->readahead / 2)
+		return 0;
+
+	end = next + fs->readahead;
+	if (end > total)
+		end = total;
+
+	for (uint32_t i = fh->ra_end; i < end; ++i, ++n)
+		block_to_chs(fs,
+			     fh->blocks[i / per_block],
+			     (i % per_block) * ss,
+			     &fh->iov[n].cylinder,
+			     &fh->iov[n].head,
+			     &fh->iov[n].sector);
+	fh->ra_end = end;
+	return cache_prefetch(fs, fh->iov, n);
+}
+
+/* Read from the given position up to count bytes, or the end of the file.
+ * The position is moved after the data read. */
+static int read_at(struct cpm_fs *fs,
+		   struct cpm_fs_file_handle *fh,
+		   struct cpm_fs_sector_io *iov,
+		   uint32_t *block,
+		   uint32_t *offset,
+		   uint8_t *buf,
+		   size_t count,
+		   size_t *out_read)
+{
+	uint32_t block_size;
+	uint32_t size_to_read;
+	int ret;
+
+	*out_read = 0;
+	while (count && *block < fh->block_count) {
+		block_size = fs->attr.block_size;
+		if (*block == fh->block_count - 1)
+			block_size = fh->last_block_size;
+		if (*offset >= block_size) /* EOF */
+			break;
+
+		/* Up to the end of the block */
+		size_to_read = block_size - *offset;
 		if (count < size_to_read)
-			size_to_read = count;
+			size_to_read = (uint32_t)count;
+
+		ret = read_block(fs,
+				 iov,
+				 fh->blocks[*block],
+				 buf,
+				 *offset,
+				 *offset + size_to_read);
+		if (ret != 0)
+			return ret;
 
-		/* cache -> out*/
-		memcpy(buf, fs->cache + sector_offset, size_to_read);
 		*out_read += size_to_read;
 		count -= size_to_read;
-		fh->offset += size_to_read;
+		*offset += size_to_read;
 		buf += size_to_read;
 
-		/* Keep reading the same block */
-		if (fh->offset < block_size)
-			continue;
-
 		/* Next block */
-		fh->block += 1;
-		fh->offset = 0;
-		if ((fs->block_addressing == CPM_BLOCK_ADDR_8 &&
-		     fh->block >= 16) ||
-		    (fs->block_addressing == CPM_BLOCK_ADDR_16 &&
-		     fh->block >= 8)) {
-			fh->entry = get_next_extent(fs, fh->entry);
-			fh->block = 0;
-			if (!fh->entry) /* EOF */
-				break;
-			entry = &fs->superblock.entries[fh->entry];
-			last_extent = get_last_extent(fs, entry);
+		if (*offset == fs->attr.block_size) {
+			*block += 1;
+			*offset = 0;
 		}
 	}
+	return 0;
+}
 
-	return CPM_SUCCESS;
+static int read_cursor(struct cpm_fs *fs,
+		       struct cpm_fs_file_handle *fh,
+		       uint8_t *buf,
+		       size_t count,
+		       size_t *out_read)
+{
+	int ret;
+
+	if ((ret = drop_write_buffer(fs, fh)))
+		return ret;
+
+	/* Only read ahead of sequential reads. The current sectors are part
+	 * of the request, so they're fetched in the same batch. */
+	if (handle_pos(fs, fh) != fh->ra_pos)
+		fh->ra_end = 0;
+	else if (fs->readahead && (ret = readahead(fs, fh)))
+		return ret;
+
+	ret = read_at(
+		fs, fh, fh->iov, &fh->block, &fh->offset, buf, count, out_read);
+	fh->ra_pos = handle_pos(fs, fh);
+	return ret;
 }
 
-static int write_sector(struct cpm_fs *fs,
-			uint32_t c,
-			uint32_t h,
-			uint32_t s,
-			const uint8_t *buf,
-			size_t count,
-			size_t offset)
+enum cpm_fs_status cpm_fs_read(struct cpm_fs *fs,
+			       struct cpm_fs_file_handle *fh,
+			       uint8_t *buf,
+			       size_t count,
+			       size_t *out_read)
 {
 	int ret;
 
-	/* Trying to write more than a sector size, should not happen */
-	if (count + offset > fs->attr.sector_size)
-		return 1;
+	if (!fs || !fh || !buf || count == 0 || !out_read)
+		return CPM_ERR_INVALID_ARG;
 
-	/* If we're writing in the middle of a sector, read the existing data
-	 * beforehand as not to overwrite the data at the start. */
-	if (offset)
-		if (fs->read_sector(fs->userdata, c, h, s, fs->cache) != 0)
-			return CPM_ERR_SECTOR_READ;
+	fs_lock_handle(fs, fh);
+	ret = read_cursor(fs, fh, buf, count, out_read);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
 
-	memcpy(fs->cache + offset, buf, count);
-	ret = fs->write_sector(fs->userdata, c, h, s, fs->cache);
+static int pread_at(struct cpm_fs *fs,
+		    struct cpm_fs_file_handle *fh,
+		    uint8_t *buf,
+		    size_t count,
+		    size_t offset,
+		    size_t *out_read)
+{
+	struct cpm_fs_sector_io *iov;
+	uint32_t block, block_offset;
+	int ret;
 
-	return (ret == 0 ? 0 : -CPM_ERR_SECTOR_WRITE);
+	/* Buffered data must be on disk to be read back */
+	if ((ret = flush_write_buffer(fs, fh)))
+		return ret;
+
+	*out_read = 0;
+	if (offset >= handle_size(fs, fh))
+		return 0;
+
+	/* Several threads may use the same handle, fh->iov can't be used */
+	iov = (struct cpm_fs_sector_io *)malloc(
+		fs->attr.block_size / fs->attr.sector_size *
+		sizeof(struct cpm_fs_sector_io));
+	if (!iov)
+		return CPM_ERR_NOMEM;
+
+	block = (uint32_t)(offset / fs->attr.block_size);
+	block_offset = (uint32_t)(offset % fs->attr.block_size);
+	ret = read_at(fs, fh, iov, &block, &block_offset, buf, count, out_read);
+	free(iov);
+	return ret;
 }
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+enum cpm_fs_status cpm_fs_pread(struct cpm_fs *fs,
+				struct cpm_fs_file_handle *fh,
+				uint8_t *buf,
+				size_t count,
+				size_t offset,
+				size_t *out_read)
+{
+	int ret;
 
-static ssize_t write_block(struct cpm_fs *fs,
-			   uint16_t block,
-			   uint32_t offset,
-			   uint8_t *buf,
-			   size_t count)
+	if (!fs || !fh || !buf || count == 0 || !out_read)
+		return CPM_ERR_INVALID_ARG;
+
+	fs_lock_handle(fs, fh);
+	ret = pread_at(fs, fh, buf, count, offset, out_read);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
+
+/* Add the given free block at the end of the file, and a new entry if
+ * needed */
+static int push_block(struct cpm_fs *fs,
+		      struct cpm_fs_file_handle *fh,
+		      uint16_t block)
 {
-	size_t written = 0;
-	uint32_t c, h, s;
-	uint32_t to_write;
+	uint8_t per_entry = max_blocks_per_entry(fs);
+	uint32_t group = fh->block_count / per_entry;
+	int entry_idx;
 	int ret;
 
-	while (written < MIN(count, fs->attr.block_size - offset)) {
-		block_to_chs(fs, block, written + offset, &c, &h, &s);
-
-		to_write = MIN(fs->attr.sector_size, count - written);
-		if (offset > 0 && written == 0) {
-			/* Only apply offset to the first sector */
-			uint32_t sector_off = offset % fs->attr.sector_size;
-			to_write = MIN(to_write,
-				       fs->attr.sector_size - sector_off);
-			ret = write_sector(
-				fs, c, h, s, buf, to_write, sector_off);
+	if (group == fh->entry_count) {
+		/* Physical extent full, allocate new one */
+		entry_idx = alloc_new_extent(
+			fs,
+			&fs->superblock.entries[fh->entries[group - 1]]);
+		if (entry_idx < 0)
+			return -entry_idx;
+		if ((ret = map_push_entry(fh, (uint32_t)entry_idx))) {
+			/* Not in the map, the next append would add another */
+			wipe_extent(fs, entry_idx);
+			return ret;
+		}
+	}
+
+	if ((ret = map_push_block(fh, block)))
+		return ret;
+	av_set(fs, block);
+	entry_set_block(fs,
+			&fs->superblock.entries[fh->entries[group]],
+			(uint8_t)(fh->block_count - 1 - group * per_entry),
+			block);
+	ft_touch(fs, fh->entries[group]);
+	mark_entry_dirty(fs, fh->entries[group]);
+	fh->last_block_size = 0;
+	return 0;
+}
+
+/* Add a new block at the end of the file, and a new entry if needed */
+static int append_block(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	uint16_t block;
+
+	block = find_free_block(
+		fs, fh->block_count ? fh->blocks[fh->block_count - 1] : 0);
+	if (!block)
+		return CPM_ERR_DISK_FULL;
+	return push_block(fs, fh, block);
+}
+
+/* Update extent number and record count of the last entry after the file
+ * was extended. */
+static void update_file_end(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	uint8_t per_entry = max_blocks_per_entry(fs);
+	uint32_t group = (fh->block_count - 1) / per_entry;
+	uint32_t entry_idx = fh->entries[group];
+	cpm_entry *entry = &fs->superblock.entries[entry_idx];
+	uint32_t bytes, logical, first;
+
+	/* Bytes used in the entry and logical extent of the last one */
+	bytes = (fh->block_count - 1 - group * per_entry) *
+			fs->attr.block_size +
+		fh->last_block_size;
+	logical = (bytes - 1) / 0x4000;
+
+	/* Logical extents are numbered after the previous entry */
+	first = 0;
+	if (group > 0)
+		first = extent_nb(
+				&fs->superblock.entries[fh->entries[group - 1]]) +
+			1;
+
+	set_extent_nb(entry, first + logical);
+	entry->rc = (uint8_t)((bytes - logical * 0x4000 + 127) / 128);
+	ft_touch(fs, entry_idx);
+	mark_entry_dirty(fs, entry_idx);
+}
+
+/* Write at the current position, the file must already reach it */
+static int write_at_cursor(struct cpm_fs *fs,
+			   struct cpm_fs_file_handle *file,
+			   uint8_t *buf,
+			   size_t count,
+			   size_t *out_written)
+{
+	ssize_t ret;
+	size_t to_write;
+
+	*out_written = 0;
+	while (*out_written < count) {
+		if (file->block == file->block_count) {
+			ret = append_block(fs, file);
+			if (ret)
+				return (int)ret;
+		}
+
+		to_write = MIN(count - *out_written,
+			       fs->attr.block_size - file->offset);
+
+		if (file->wbuf_block != file->block) {
+			/* Moving to another block */
+			if ((ret = flush_write_buffer(fs, file)))
+				return (int)ret;
+			file->wbuf_block = CPM_NO_ENTRY;
+		}
+
+		if (file->wbuf_block == CPM_NO_ENTRY &&
+		    file->offset % fs->attr.sector_size == 0 &&
+		    file->offset + to_write == fs->attr.block_size) {
+			/* Nothing buffered and the rest of the block is
+			 * written, no need to copy it */
+			ret = write_block(fs,
+					  file->blocks[file->block],
+					  file->offset,
+					  buf + *out_written,
+					  to_write,
+					  false);
+			if (ret < 0)
+				return (int)-ret;
 		} else {
-			ret = write_sector(fs, c, h, s, buf, to_write, 0);
+			if (file->wbuf_block == CPM_NO_ENTRY) {
+				file->wbuf_block = file->block;
+				file->wbuf_start = file->offset;
+				file->wbuf_flushed = file->offset;
+			}
+			memcpy(file->wbuf + file->offset,
+			       buf + *out_written,
+			       to_write);
+			file->wbuf_end = file->offset + (uint32_t)to_write;
+		}
+		*out_written += to_write;
+		file->offset += (uint32_t)to_write;
+
+		/* Update record count if the file grew */
+		if (file->block == file->block_count - 1 &&
+		    file->offset > file->last_block_size) {
+			file->last_block_size = file->offset;
+			update_file_end(fs, file);
 		}
 
-		if (ret != 0)
-			return -CPM_ERR_SECTOR_WRITE;
+		/* Next block */
+		if (file->offset == fs->attr.block_size) {
+			if ((ret = flush_write_buffer(fs, file)))
+				return (int)ret;
+			file->wbuf_block = CPM_NO_ENTRY;
+			file->block += 1;
+			file->offset = 0;
+		}
+	}
+
+	return 0;
+}
 
-		written += to_write;
-		buf = (uint8_t *)buf + to_write;
+/* Fill the file with zeros up to the current position, after a seek past
+ * the end. CP/M files can't have holes. */
+static int fill_gap(struct cpm_fs *fs, struct cpm_fs_file_handle *fh)
+{
+	size_t pos = handle_pos(fs, fh);
+	size_t size = handle_size(fs, fh);
+	size_t written;
+	int ret = 0;
+
+	if (pos <= size)
+		return 0;
+
+	set_handle_pos(fs, fh, size);
+	memset(fs->scratch, 0, fs->attr.sector_size);
+	while (size < pos && !ret) {
+		ret = write_at_cursor(fs,
+				      fh,
+				      fs->scratch,
+				      MIN(pos - size, fs->attr.sector_size),
+				      &written);
+		size += written;
 	}
-	return (ssize_t)written;
+	return ret;
 }
 
 enum cpm_fs_status cpm_fs_write(struct cpm_fs *fs,
@@ -242,93 +757,167 @@ enum cpm_fs_status cpm_fs_write(struct cpm_fs *fs,
 				size_t count,
 				size_t *out_written)
 {
-	cpm_entry *entry;
-	uint16_t block;
-	ssize_t ret;
-	size_t to_write;
+	int ret;
 
-	if (!fs || !file || !buf || !fs->write_sector || !out_written)
+	if (!fs || !file || !buf || !out_written ||
+	    (!fs->io.write_sector && !fs->io.write_sectors &&
+	     !(fs->io.read_track && fs->io.write_track)))
 		return CPM_ERR_INVALID_ARG;
 
 	if (file->mode & CPM_MODE_RDONLY)
 		return CPM_ERR_FILE_READ_ONLY;
 
-	entry = &fs->superblock.entries[file->entry];
-
+	fs_lock(fs);
 	*out_written = 0;
-	while (*out_written < count) {
-		if (fs->block_addressing == CPM_BLOCK_ADDR_8)
-			block = entry->block_ptr[file->block];
-		else
-			block = entry->block_ptr_w[file->block];
+	/* Under the lock, threads can share the handle */
+	if (!file->wbuf) {
+		file->wbuf = (uint8_t *)malloc(fs->attr.block_size);
+		if (!file->wbuf) {
+			ret = CPM_ERR_NOMEM;
+			goto end;
+		}
+	}
+	ret = fill_gap(fs, file);
+	if (!ret)
+		ret = write_at_cursor(fs, file, buf, count, out_written);
+end:
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
 
-		/* Write to current block until it's full*/
-		if (block > 0 && file->offset < fs->attr.block_size) {
-			to_write = MIN(count - *out_written,
-				       fs->attr.block_size - file->offset);
-			ret = write_block(fs,
-					  block,
-					  file->offset,
-					  (uint8_t *)buf + *out_written,
-					  to_write);
-			if (ret < 0)
-				return -ret;
-			*out_written += ret;
-			file->offset += (uint32_t)ret;
+enum cpm_fs_status cpm_fs_pwrite(struct cpm_fs *fs,
+				 struct cpm_fs_file_handle *file,
+				 uint8_t *buf,
+				 size_t count,
+				 size_t offset,
+				 size_t *out_written)
+{
+	uint32_t block, block_offset;
+	int ret;
+
+	if (!fs || !file || !buf || !out_written || offset > UINT32_MAX ||
+	    (!fs->io.write_sector && !fs->io.write_sectors &&
+	     !(fs->io.read_track && fs->io.write_track)))
+		return CPM_ERR_INVALID_ARG;
+
+	if (file->mode & CPM_MODE_RDONLY)
+		return CPM_ERR_FILE_READ_ONLY;
+
+	fs_lock(fs);
+	/* Write through the cursor, then put it back. Same as cpm_fs_seek,
+	 * written blocks must be kept. */
+	*out_written = 0;
+	/* Under the lock, threads can share the handle */
+	if (!file->wbuf) {
+		file->wbuf = (uint8_t *)malloc(fs->attr.block_size);
+		if (!file->wbuf) {
+			ret = CPM_ERR_NOMEM;
+			goto end;
 		}
+	}
+	if ((ret = drop_write_buffer(fs, file)))
+		goto end;
+	file->fresh_from = file->block_count;
+
+	block = file->block;
+	block_offset = file->offset;
+	set_handle_pos(fs, file, offset);
+	ret = fill_gap(fs, file);
+	if (!ret)
+		ret = write_at_cursor(fs, file, buf, count, out_written);
+	if (!ret)
+		ret = drop_write_buffer(fs, file);
+
+	file->block = block;
+	file->offset = block_offset;
+end:
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
 
-		/* Update record count to indicate file size */
-		uint32_t bytes_in_extent =
-			(file->offset + file->block * fs->attr.block_size) %
-			0x4000;
-		entry->rc = (uint8_t)((bytes_in_extent + 127) / 128);
+enum cpm_fs_status cpm_fs_seek(struct cpm_fs *fs,
+			       struct cpm_fs_file_handle *file,
+			       int64_t offset,
+			       int whence,
+			       size_t *out_pos)
+{
+	int64_t base;
+	int ret;
 
-		/* Done? */
-		if (*out_written >= count)
-			break;
+	if (!fs || !file)
+		return CPM_ERR_INVALID_ARG;
+
+	switch (whence) {
+	case SEEK_SET:
+		base = 0;
+		break;
+	case SEEK_CUR:
+		base = (int64_t)handle_pos(fs, file);
+		break;
+	case SEEK_END:
+		base = (int64_t)handle_size(fs, file);
+		break;
+	default:
+		return CPM_ERR_INVALID_ARG;
+	}
+
+	/* Sizes are kept in 32 bits, far above what CP/M can address */
+	if ((offset < 0 && base + offset < 0) ||
+	    (offset > 0 && offset > (int64_t)UINT32_MAX - base))
+		return CPM_ERR_INVALID_ARG;
+
+	fs_lock_handle(fs, file);
+	ret = drop_write_buffer(fs, file);
+	fs_unlock(fs);
+	if (ret)
+		return (enum cpm_fs_status)ret;
+	/* Blocks written through this handle may be written again, their
+	 * contents must be kept from now on */
+	file->fresh_from = file->block_count;
+
+	set_handle_pos(fs, file, (size_t)(base + offset));
+	if (out_pos)
+		*out_pos = handle_pos(fs, file);
+	return CPM_SUCCESS;
+}
+
+enum cpm_fs_status cpm_fs_tell(struct cpm_fs *fs,
+			       struct cpm_fs_file_handle *file,
+			       size_t *out_pos)
+{
+	if (!fs || !file || !out_pos)
+		return CPM_ERR_INVALID_ARG;
+
+	*out_pos = handle_pos(fs, file);
+	return CPM_SUCCESS;
+}
+
+#undef MIN
 
-		/* Next block */
-		if (block == 0 || file->offset >= fs->attr.block_size) {
-			if (block != 0)
-				file->block += 1;
-			file->offset = 0;
+static int unlink_file(struct cpm_fs *fs, const char *filename, int user)
+{
+	int32_t entry_idx;
+	uint32_t next;
+	int ret;
 
-			if (file->block >= max_blocks_per_entry(fs)) {
-				/* Physical extent full, allocate new one */
-				int new_entry_idx = alloc_new_extent(fs, entry);
-				if (new_entry_idx < 0)
-					break;
+	if ((ret = ensure_checked(fs)))
+		return ret;
 
-				file->entry = (uint32_t)new_entry_idx;
-				file->block = 0;
-				file->offset = 0;
-				entry = &fs->superblock.entries[file->entry];
-			}
+	entry_idx = find_file(fs, filename, user);
+	if (entry_idx == -1)
+		return CPM_ERR_FILE_NOT_FOUND;
 
-			/* Update number when starting a new logical extent  */
-			if (file->block != 0 &&
-			    file->block % (0x4000 / fs->attr.block_size) == 1)
-				set_extent_nb(entry, extent_nb(entry) + 1);
-
-			/* Allocate new block */
-			uint16_t new_block = find_free_block(fs);
-			if (!new_block)
-				return CPM_ERR_DISK_FULL;
-			av_set(fs, new_block);
-			entry_set_block(fs, entry, file->block, new_block);
-		}
+	for (uint32_t i = (uint32_t)entry_idx; i != CPM_NO_ENTRY; i = next) {
+		next = get_next_extent(fs, i);
+		wipe_extent(fs, i);
 	}
 
 	return CPM_SUCCESS;
 }
 
-#undef MIN
-
 enum cpm_fs_status
 cpm_fs_unlink(struct cpm_fs *fs, const char *filename, int user)
 {
-	int32_t entry_idx;
-	uint8_t header[13];
 	int ret;
 
 	if (!fs || !filename)
@@ -337,26 +926,18 @@ cpm_fs_unlink(struct cpm_fs *fs, const char *filename, int user)
 	if (!is_valid_user(user))
 		return CPM_ERR_INVALID_USER;
 
-	entry_idx = find_file(fs, filename, user);
-	if (entry_idx == -1)
-		return CPM_ERR_FILE_NOT_FOUND;
-
-	/* user + filename + type */
-	memcpy(header, &fs->superblock.entries[entry_idx], 12);
-	for (uint32_t i = 0; i < fs->superblock.count; ++i)
-		if (memcmp(header, &fs->superblock.entries[i], 12) == 0)
-			wipe_extent(fs, i);
-
-	return CPM_SUCCESS;
+	fs_lock(fs);
+	ret = unlink_file(fs, filename, user);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
 }
 
-enum cpm_fs_status cpm_fs_rename(struct cpm_fs *fs,
-				 const char *old_path,
-				 int old_user,
-				 const char *new_path,
-				 int new_user)
+static int rename_path(struct cpm_fs *fs,
+		       const char *old_path,
+		       int old_user,
+		       const char *new_path,
+		       int new_user)
 {
-	uint8_t header[13];
 	char filename[8];
 	char *parsed_file;
 	char ext[3];
@@ -366,10 +947,8 @@ enum cpm_fs_status cpm_fs_rename(struct cpm_fs *fs,
 	int entry_idx;
 	int ret;
 
-	if (!fs || !old_path || !new_path)
-		return CPM_ERR_INVALID_ARG;
-	if (!is_valid_user(old_user) || !is_valid_user(new_user))
-		return CPM_ERR_INVALID_USER;
+	if ((ret = ensure_checked(fs)))
+		return ret;
 
 	memset(filename, 0x20, 8);
 	memset(ext, 0x20, 3);
@@ -393,62 +972,144 @@ enum cpm_fs_status cpm_fs_rename(struct cpm_fs *fs,
 	if (entry_idx == -1)
 		return CPM_ERR_FILE_NOT_FOUND;
 
-	/* Copy flags */
-	for (int i = 0; i < 3; ++i)
-		ext[i] =
-			(fs->superblock.entries[entry_idx].extension[i] & 0x40);
-
-	/* user + filename + type */
-	memcpy(header, &fs->superblock.entries[entry_idx], 12);
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		cpm_entry *entry = &fs->superblock.entries[i];
-		if (memcmp(header, entry, 12) == 0) {
-			memcpy(entry->file, filename, 8);
-			memcpy(entry->extension, ext, 3);
-		}
-	}
+	/* Update every extent, flags are kept */
+	ft_rename(fs,
+		  fs->files.entry_file[entry_idx],
+		  (uint8_t)new_user,
+		  filename,
+		  ext);
 
 	return CPM_SUCCESS;
 }
 
+enum cpm_fs_status cpm_fs_rename(struct cpm_fs *fs,
+				 const char *old_path,
+				 int old_user,
+				 const char *new_path,
+				 int new_user)
+{
+	int ret;
+
+	if (!fs || !old_path || !new_path)
+		return CPM_ERR_INVALID_ARG;
+	if (!is_valid_user(old_user) || !is_valid_user(new_user))
+		return CPM_ERR_INVALID_USER;
+
+	fs_lock(fs);
+	ret = rename_path(fs, old_path, old_user, new_path, new_user);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
+
 enum cpm_fs_status cpm_fs_get_available_space(struct cpm_fs *fs,
 					      size_t *out_space)
 {
-	uint16_t total_blocks;
-	size_t available_space = 0;
+	int ret;
 
 	if (!fs || !out_space)
 		return CPM_ERR_INVALID_ARG;
 
-	total_blocks = fs->disk_size / fs->attr.block_size;
-	for (uint16_t i = 0; i < total_blocks; ++i)
-		if (av_get(fs, i) == 0)
-			available_space += fs->attr.block_size;
+	/* Building the allocation vector of a lazy mount modifies fs */
+	fs_lock(fs);
+	if (!(ret = ensure_checked(fs)))
+		*out_space = (size_t)fs->av_free * fs->attr.block_size;
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
 
-	*out_space = available_space;
-	return CPM_SUCCESS;
+enum cpm_fs_status cpm_fs_get_usage(struct cpm_fs *fs,
+				    struct cpm_fs_usage *out_users,
+				    size_t *out_free)
+{
+	int ret;
+
+	if (!fs || !out_users || !out_free)
+		return CPM_ERR_INVALID_ARG;
+
+	fs_lock(fs);
+	if (!(ret = ensure_checked(fs))) {
+		memcpy(out_users, fs->files.users, sizeof(fs->files.users));
+		*out_free = (size_t)fs->av_free * fs->attr.block_size;
+	}
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
+
+enum cpm_fs_status cpm_fs_get_file_usage(struct cpm_fs *fs,
+					 const char *pathname,
+					 int user,
+					 struct cpm_fs_usage *out)
+{
+	struct cpm_file *file;
+	int32_t entry_idx;
+
+	if (!fs || !pathname || !out)
+		return CPM_ERR_INVALID_ARG;
+
+	if (!is_valid_user(user))
+		return CPM_ERR_INVALID_USER;
+
+	fs_lock_shared(fs);
+	entry_idx = find_file(fs, pathname, user);
+	if (entry_idx != -1) {
+		file = &fs->files.files[fs->files.entry_file[entry_idx]];
+		out->files = 1;
+		out->blocks = file->blocks;
+		out->bytes = file->size;
+	}
+	fs_unlock(fs);
+
+	return (entry_idx == -1) ? CPM_ERR_FILE_NOT_FOUND : CPM_SUCCESS;
 }
 
 enum cpm_fs_status cpm_fs_close(struct cpm_fs *fs,
 				struct cpm_fs_file_handle *file_handle)
 {
+	int ret;
+
 	if (!fs || !file_handle)
 		return CPM_ERR_INVALID_ARG;
 
-	free(file_handle);
-	return CPM_SUCCESS;
+	fs_lock_handle(fs, file_handle);
+	ret = flush_write_buffer(fs, file_handle);
+
+	pthread_mutex_lock(&fs->handles_lock);
+	if (file_handle->prev)
+		file_handle->prev->next = file_handle->next;
+	else
+		fs->handles = file_handle->next;
+	if (file_handle->next)
+		file_handle->next->prev = file_handle->prev;
+	pthread_mutex_unlock(&fs->handles_lock);
+	fs_unlock(fs);
+
+	free_handle(file_handle);
+	return (enum cpm_fs_status)ret;
 }
 
-enum cpm_fs_status cpm_fs_readdir(struct cpm_fs *fs,
-				  struct cpm_fs_dir *dirp,
-				  struct cpm_fs_file **out_file)
+void get_file_info(struct cpm_fs *fs, uint32_t ino, struct cpm_fs_file *out)
 {
-	cpm_entry *entry;
-	uint8_t *filename_out;
-	int i;
+	cpm_entry *entry = &fs->superblock.entries[ino];
 
-	if (!fs || !dirp || !out_file)
-		return CPM_ERR_INVALID_ARG;
+	memset(out, 0, sizeof(struct cpm_fs_file));
+	entry_get_name(entry, out->d_name);
+
+	/* File attributes, CP/M >= 2.0 */
+	if (F_IS_READONLY(entry))
+		out->d_flags |= CPM_FS_FLAG_READONLY;
+	if (F_IS_SYSTEMFILE(entry))
+		out->d_flags |= CPM_FS_FLAG_SYSTEM;
+	if (F_IS_ARCHIVED(entry))
+		out->d_flags |= CPM_FS_FLAG_ARCHIVED;
+
+	out->d_user = entry->status & 0x0F;
+	out->d_size = get_filesize(fs, entry);
+}
+
+static void next_file(struct cpm_fs *fs,
+		      struct cpm_fs_dir *dirp,
+		      struct cpm_fs_file **out_file)
+{
 
 	while ((uint32_t)++dirp->current_file_ino < fs->superblock.count) {
 		/* Iterate until we find a file entry */
@@ -460,39 +1121,23 @@ enum cpm_fs_status cpm_fs_readdir(struct cpm_fs *fs,
 	if ((uint32_t)dirp->current_file_ino >= fs->superblock.count) {
 		/* Done iterating through all entries */
 		*out_file = NULL;
-		return CPM_SUCCESS;
-	}
-
-	entry = &fs->superblock.entries[dirp->current_file_ino];
-
-	/* Copy file name without status flags */
-	memset(&dirp->file, 0, sizeof(struct cpm_fs_file));
-	filename_out = (uint8_t *)dirp->file.d_name;
-
-	for (i = 0; i < 8; ++i)
-		filename_out[i] = entry->file[i] & 0x7f;
-	for (i = 7; i >= 0 && filename_out[i] == 0x20; --i)
-		filename_out[i] = 0;
-	filename_out += i + 1;
-	if ((entry->extension[0] & 0x7f) != 0x20) {
-		*(filename_out++) = '.';
-		i = -1;
-		while (++i < 3 && (entry->extension[i] & 0x7f) != 0x20)
-			*(filename_out++) = entry->extension[i] & 0x7f;
+		return;
 	}
 
-	/* File attributes, CP/M >= 2.0 */
-	if (F_IS_READONLY(entry))
-		dirp->file.d_flags |= CPM_FS_FLAG_READONLY;
-	if (F_IS_SYSTEMFILE(entry))
-		dirp->file.d_flags |= CPM_FS_FLAG_SYSTEM;
-	if (F_IS_ARCHIVED(entry))
-		dirp->file.d_flags |= CPM_FS_FLAG_ARCHIVED;
+	get_file_info(fs, dirp->current_file_ino, &dirp->file);
+	*out_file = &dirp->file;
+}
 
-	dirp->file.d_user = entry->status & 0x0F;
-	dirp->file.d_size = get_filesize(fs, entry);
+enum cpm_fs_status cpm_fs_readdir(struct cpm_fs *fs,
+				  struct cpm_fs_dir *dirp,
+				  struct cpm_fs_file **out_file)
+{
+	if (!fs || !dirp || !out_file)
+		return CPM_ERR_INVALID_ARG;
 
-	*out_file = &dirp->file;
+	fs_lock_shared(fs);
+	next_file(fs, dirp, out_file);
+	fs_unlock(fs);
 	return CPM_SUCCESS;
 }
 
@@ -513,6 +1158,7 @@ enum cpm_fs_status cpm_fs_getattr(struct cpm_fs *fs,
 		return CPM_ERR_INVALID_ARG;
 
 	*out_attrs = 0;
+	fs_lock_shared(fs);
 	cpm_entry *entry = &fs->superblock.entries[file->entry];
 	if (F_IS_READONLY(entry))
 		*out_attrs |= CPM_FS_FLAG_READONLY;
@@ -520,6 +1166,7 @@ enum cpm_fs_status cpm_fs_getattr(struct cpm_fs *fs,
 		*out_attrs |= CPM_FS_FLAG_SYSTEM;
 	if (F_IS_ARCHIVED(entry))
 		*out_attrs |= CPM_FS_FLAG_ARCHIVED;
+	fs_unlock(fs);
 
 	return CPM_SUCCESS;
 }
@@ -527,77 +1174,71 @@ enum cpm_fs_status cpm_fs_getattr(struct cpm_fs *fs,
 enum cpm_fs_status
 cpm_fs_setattr(struct cpm_fs *fs, struct cpm_fs_file_handle *file, int attrs)
 {
+	int ret;
+
 	if (!fs || !file || !attrs)
 		return CPM_ERR_INVALID_ARG;
 
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		/* Compare user, filename, ext */
+	fs_lock(fs);
+	if ((ret = ensure_checked(fs))) {
+		fs_unlock(fs);
+		return (enum cpm_fs_status)ret;
+	}
+
+	/* Flags are not part of the file table key, no need to rehash */
+	for (uint32_t i = get_first_extent(fs, file->entry); i != CPM_NO_ENTRY;
+	     i = get_next_extent(fs, i)) {
 		cpm_entry *entry = &fs->superblock.entries[i];
-		if (memcmp(entry, &fs->superblock.entries[file->entry], 12) ==
-		    0) {
-			if (attrs & CPM_FS_FLAG_READONLY)
-				F_SET_READONLY(entry);
-			if (attrs & CPM_FS_FLAG_SYSTEM)
-				F_SET_SYSTEMFILE(entry);
-			if (attrs & CPM_FS_FLAG_ARCHIVED)
-				F_SET_ARCHIVED(entry);
-		}
+		if (attrs & CPM_FS_FLAG_READONLY)
+			F_SET_READONLY(entry);
+		if (attrs & CPM_FS_FLAG_SYSTEM)
+			F_SET_SYSTEMFILE(entry);
+		if (attrs & CPM_FS_FLAG_ARCHIVED)
+			F_SET_ARCHIVED(entry);
+		mark_entry_dirty(fs, i);
 	}
+	fs_unlock(fs);
 
 	return CPM_SUCCESS;
 }
 
-static void invert_superblock_endianness(struct cpm_fs *fs)
-{
-	uint16_t tmp;
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		tmp = fs->superblock.entries[i].block_ptr_w[i];
-		fs->superblock.entries[i].block_ptr_w[i] =
-			((tmp & 0xFF00) >> 8) | ((tmp & 0x00FF) << 8);
-	}
-}
-
 /* Store superblock and parse directory entries */
 static int read_superblock(struct cpm_fs *fs)
 {
-	int i = 0, j = 0;
-	uint32_t c, h, s;
 	struct cpm_superblock *sb = &fs->superblock;
 	uint32_t entries_c = fs->attr.sector_size / sizeof(cpm_entry);
+	struct cpm_fs_sector_io *io = fs->iov;
 	int ret;
 
-	/* Locate superblock */
-	block_to_chs(fs, 0, 0, &c, &h, &s);
-
 	sb->count = fs->attr.max_dir_entries;
-	sb->entries = (cpm_entry *)malloc(sizeof(cpm_entry) * sb->count);
-	if (!sb->entries)
+	sb->sectors = (sb->count + entries_c - 1) / entries_c;
+	/* Whole sectors, so they can be read and written in place */
+	sb->entries = (cpm_entry *)malloc((size_t)sb->sectors *
+					  fs->attr.sector_size);
+	sb->dirty = (uint64_t *)calloc(BITMAP_WORDS(sb->sectors),
+				       sizeof(uint64_t));
+	if (!sb->entries || !sb->dirty)
 		return CPM_ERR_NOMEM;
 
-	while ((uint32_t)i < sb->count) {
-		ret = fs->read_sector(fs->userdata, c, h, s, fs->cache);
-		if (ret != 0)
-			return CPM_ERR_SECTOR_READ;
-
-		for (j = 0; j < entries_c && i + j < sb->count; ++j)
-			memcpy(&sb->entries[i + j],
-			       fs->cache + j * sizeof(cpm_entry),
-			       sizeof(cpm_entry));
-
-		i += j;
-		block_to_chs(fs, 0, (i * sizeof(cpm_entry)), &c, &h, &s);
+	for (uint32_t i = 0; i < sb->sectors; ++i) {
+		block_to_chs(fs,
+			     0,
+			     i * fs->attr.sector_size,
+			     &io[i].cylinder,
+			     &io[i].head,
+			     &io[i].sector);
+		io[i].buf = (uint8_t *)sb->entries + i * fs->attr.sector_size;
 	}
+	ret = disk_read(fs, io, sb->sectors);
+	if (ret != 0)
+		return ret;
 
 	/* Available disk size for extents */
 	fs->disk_size = get_disk_size(fs);
 	if (fs->disk_size <= 256 * fs->attr.block_size)
-		fs->block_addressing = CPM_BLOCK_ADDR_8;
+		set_block_addressing(fs, CPM_BLOCK_ADDR_8);
 	else
-		fs->block_addressing = CPM_BLOCK_ADDR_16;
-
-	/* CP/M headers use little endian. Adapt if host is big endian. */
-	if (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
-		invert_superblock_endianness(fs);
+		set_block_addressing(fs, CPM_BLOCK_ADDR_16);
 
 	return 0;
 }
@@ -646,18 +1287,16 @@ static enum cpm_fs_status set_skew_settings(struct cpm_fs *fs,
 	return CPM_SUCCESS;
 }
 
-enum cpm_fs_status cpm_fs_new(struct cpm_fs_attr *attributes,
-			      read_sector_cb get_sector_cb,
-			      write_sector_cb set_sector_cb,
-			      void *userdata,
-			      struct cpm_fs **out)
+/* Allocate a filesystem and load its directory, without checking it */
+static int fs_load(struct cpm_fs_attr *attributes,
+		   const struct cpm_fs_io *io,
+		   void *userdata,
+		   struct cpm_fs **out)
 {
 	struct cpm_fs *fs;
+	uint32_t dir_sectors;
 	int err = 0;
 
-	if (!get_sector_cb || !attributes || !out)
-		return CPM_ERR_INVALID_ARG;
-
 	fs = (struct cpm_fs *)calloc(sizeof(struct cpm_fs), 1);
 	if (!fs)
 		return CPM_ERR_NOMEM;
@@ -665,23 +1304,103 @@ enum cpm_fs_status cpm_fs_new(struct cpm_fs_attr *attributes,
 	fs->attr = *attributes;
 	if ((err = set_skew_settings(fs, attributes)))
 		goto error;
+	if ((err = chs_init(fs)))
+		goto error;
 
-	fs->read_sector = get_sector_cb;
-	fs->write_sector = set_sector_cb;
+	fs->io = *io;
 	fs->userdata = userdata;
-	fs->cache = (uint8_t *)calloc(fs->attr.sector_size, 1);
-	if (!fs->cache) {
-		err = -CPM_ERR_NOMEM;
+
+	if (pthread_rwlock_init(&fs->lock, NULL)) {
+		err = CPM_ERR_NOMEM;
+		goto error;
+	}
+	fs->lock_init = true;
+	if (pthread_mutex_init(&fs->handles_lock, NULL)) {
+		err = CPM_ERR_NOMEM;
+		goto error;
+	}
+	fs->handles_lock_init = true;
+
+	fs->scratch = (uint8_t *)calloc(fs->attr.sector_size, 1);
+	if (!fs->scratch) {
+		err = CPM_ERR_NOMEM;
+		goto error;
+	}
+
+	if ((err = cache_init(fs)))
+		goto error;
+
+	if ((err = track_init(fs)))
+		goto error;
+
+	fs->readahead = fs->attr.readahead_sectors;
+	if (fs->readahead > fs->cache.capacity)
+		fs->readahead = fs->cache.capacity;
+
+	dir_sectors = (fs->attr.max_dir_entries * sizeof(cpm_entry) +
+		       fs->attr.sector_size - 1) /
+		      fs->attr.sector_size;
+	fs->iov_cap = fs->attr.block_size / fs->attr.sector_size;
+	if (dir_sectors > fs->iov_cap)
+		fs->iov_cap = dir_sectors;
+	if (fs->readahead > fs->iov_cap)
+		fs->iov_cap = fs->readahead;
+	fs->iov = (struct cpm_fs_sector_io *)calloc(
+		fs->iov_cap, sizeof(struct cpm_fs_sector_io));
+	if (!fs->iov) {
+		err = CPM_ERR_NOMEM;
 		goto error;
 	}
 
 	if ((err = read_superblock(fs)))
 		goto error;
 
-	if ((err = check_superblock(fs)))
+	*out = fs;
+	return 0;
+error:
+	cpm_fs_destroy(fs);
+	*out = NULL;
+	return err;
+}
+
+enum cpm_fs_status cpm_fs_new(struct cpm_fs_attr *attributes,
+			      read_sector_cb get_sector_cb,
+			      write_sector_cb set_sector_cb,
+			      void *userdata,
+			      struct cpm_fs **out)
+{
+	struct cpm_fs_io io = {
+		get_sector_cb, set_sector_cb, NULL, NULL, NULL, NULL
+	};
+
+	if (!get_sector_cb)
+		return CPM_ERR_INVALID_ARG;
+
+	return cpm_fs_new_io(attributes, &io, userdata, out);
+}
+
+enum cpm_fs_status cpm_fs_new_io(struct cpm_fs_attr *attributes,
+				 const struct cpm_fs_io *io,
+				 void *userdata,
+				 struct cpm_fs **out)
+{
+	struct cpm_fs *fs;
+	int err = 0;
+
+	if (!attributes || !io || !out ||
+	    (!io->read_sector && !io->read_sectors && !io->read_track))
+		return CPM_ERR_INVALID_ARG;
+
+	if ((err = fs_load(attributes, io, userdata, &fs))) {
+		*out = NULL;
+		return err;
+	}
+
+	if (!(fs->attr.mount_flags & CPM_FS_MOUNT_LAZY) &&
+	    (err = ensure_checked(fs)))
 		goto error;
 
-	if ((err = av_build(fs)))
+	if ((err = ft_build(fs)))
 		goto error;
 
 	*out = fs;
@@ -693,25 +1412,310 @@ error:
 	return err;
 }
 
+enum cpm_fs_status cpm_fs_check(struct cpm_fs_attr *attributes,
+				read_sector_cb get_sector_cb,
+				void *userdata,
+				struct cpm_fs_check_report **out_report)
+{
+	struct cpm_fs_io io = { get_sector_cb, NULL, NULL, NULL, NULL, NULL };
+	struct cpm_fs_check_report *report;
+	struct cpm_fs *fs;
+	int err = 0;
+
+	if (!get_sector_cb || !attributes || !out_report)
+		return CPM_ERR_INVALID_ARG;
+
+	*out_report = NULL;
+	report = (struct cpm_fs_check_report *)calloc(sizeof(*report), 1);
+	if (!report)
+		return CPM_ERR_NOMEM;
+
+	if ((err = fs_load(attributes, &io, userdata, &fs))) {
+		free(report);
+		return err;
+	}
+
+	if (!(err = av_init(fs)))
+		err = check_superblock(fs, report);
+	cpm_fs_destroy(fs);
+
+	/* Disk errors are part of the report, only fail on internal ones */
+	if (err && err != (int)report->status) {
+		cpm_fs_free_check_report(report);
+		return err;
+	}
+
+	*out_report = report;
+	return CPM_SUCCESS;
+}
+
+enum cpm_fs_status cpm_fs_free_check_report(struct cpm_fs_check_report *report)
+{
+	if (!report)
+		return CPM_ERR_INVALID_ARG;
+	free(report->conflicts);
+	free(report);
+	return CPM_SUCCESS;
+}
+
 enum cpm_fs_status cpm_fs_destroy(struct cpm_fs *fs)
 {
 	if (!fs)
 		return CPM_ERR_INVALID_ARG;
+	ft_free(fs);
 	free(fs->superblock.entries);
+	free(fs->superblock.dirty);
 	free(fs->attr.skew_table);
-	free(fs->cache);
+	free(fs->chs);
+	free(fs->scratch);
+	free(fs->iov);
+	cache_free(fs);
+	track_free(fs);
+	image_close(fs->image);
 	free(fs->av);
+	free(fs->av_breaks);
+	if (fs->lock_init)
+		pthread_rwlock_destroy(&fs->lock);
+	if (fs->handles_lock_init)
+		pthread_mutex_destroy(&fs->handles_lock);
 	free(fs);
 
 	return CPM_SUCCESS;
 }
 
+static int sync_fs(struct cpm_fs *fs)
+{
+	int ret;
+
+	for (struct cpm_fs_file_handle *fh = fs->handles; fh; fh = fh->next)
+		if ((ret = flush_write_buffer(fs, fh)))
+			return ret;
+
+	if ((ret = write_superblock(fs)))
+		return ret;
+
+	if ((ret = track_flush(fs)))
+		return ret;
+
+	return fs->image ? image_sync(fs->image) : 0;
+}
+
 enum cpm_fs_status cpm_fs_sync(struct cpm_fs *fs)
 {
+	int ret;
+
 	if (!fs)
 		return CPM_ERR_INVALID_ARG;
 
-	return write_superblock(fs);
+	fs_lock(fs);
+	ret = sync_fs(fs);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
+}
+
+/* Create a file of cpm_fs_import and reserve its blocks. A single run of
+ * free blocks is used when there's one, looked for from *cursor first so
+ * files follow each other. */
+static int import_reserve(struct cpm_fs *fs,
+			  const struct cpm_fs_import_file *file,
+			  uint32_t *cursor,
+			  uint16_t **out_blocks)
+{
+	uint32_t bs = fs->attr.block_size;
+	uint32_t count = (uint32_t)((file->size + bs - 1) / bs);
+	struct cpm_fs_file_handle fh;
+	uint32_t run = CPM_NO_ENTRY;
+	uint16_t block;
+	int32_t entry;
+	int ret;
+
+	entry = find_file(fs, file->name, file->user);
+	if (entry == -1)
+		/* Should never happen */
+		return CPM_ERR_FILE_NOT_FOUND;
+
+	memset(&fh, 0, sizeof(fh));
+	fh.entry = (uint32_t)entry;
+	if ((ret = map_push_entry(&fh, fh.entry)))
+		goto end;
+
+	if (count) {
+		run = find_free_run(fs, *cursor, count);
+		if (run == CPM_NO_ENTRY)
+			run = find_free_run(fs, 1, count);
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		/* Without a large enough run, follow the allocation policy */
+		if (run != CPM_NO_ENTRY)
+			block = (uint16_t)(run + i);
+		else
+			block = find_free_block(
+				fs, i ? fh.blocks[fh.block_count - 1] : 0);
+		if (!block) {
+			ret = CPM_ERR_DISK_FULL;
+			goto end;
+		}
+		if ((ret = push_block(fs, &fh, block)))
+			goto end;
+
+		/* Record counts of every entry are set as it fills up */
+		fh.last_block_size = bs;
+		if (i == count - 1)
+			fh.last_block_size = (uint32_t)(file->size - (size_t)i * bs);
+		update_file_end(fs, &fh);
+	}
+	if (run != CPM_NO_ENTRY)
+		*cursor = run + count;
+
+end:
+	free(fh.entries);
+	if (ret)
+		free(fh.blocks);
+	else
+		*out_blocks = fh.blocks;
+	return ret;
+}
+
+/* Write a file of cpm_fs_import to its reserved blocks, iov_cap sectors at
+ * a time. buf holds iov_cap sectors. */
+static int import_write(struct cpm_fs *fs,
+			const struct cpm_fs_import_file *file,
+			const uint16_t *blocks,
+			uint8_t *buf)
+{
+	uint32_t ss = fs->attr.sector_size;
+	uint32_t per_block = fs->attr.block_size / ss;
+	uint32_t sectors = (uint32_t)((file->size + ss - 1) / ss);
+	struct cpm_fs_sector_io *io = fs->iov;
+	uint32_t n, sector;
+	size_t pos, len;
+	int ret;
+
+	for (uint32_t i = 0; i < sectors; i += n) {
+		n = sectors - i;
+		if (n > fs->iov_cap)
+			n = fs->iov_cap;
+		pos = (size_t)i * ss;
+		len = file->size - pos;
+		if (len > (size_t)n * ss)
+			len = (size_t)n * ss;
+
+		if (file->data) {
+			/* Only the last partial sector needs a copy */
+			memcpy(buf, file->data + pos + len - len % ss, len % ss);
+		} else if ((ret = file->read(file->userdata, buf, len))) {
+			return ret;
+		}
+		/* The end of the last sector is undefined on CP/M */
+		memset(buf + (file->data ? len % ss : len),
+		       0,
+		       (size_t)n * ss - len);
+
+		for (uint32_t j = 0; j < n; ++j) {
+			sector = i + j;
+			block_to_chs(fs,
+				     blocks[sector / per_block],
+				     (sector % per_block) * ss,
+				     &io[j].cylinder,
+				     &io[j].head,
+				     &io[j].sector);
+			if (!file->data)
+				io[j].buf = buf + (size_t)j * ss;
+			else if ((size_t)(j + 1) * ss <= len)
+				io[j].buf = (uint8_t *)file->data + pos +
+					    (size_t)j * ss;
+			else
+				io[j].buf = buf;
+		}
+		if ((ret = disk_write(fs, io, n)))
+			return ret;
+	}
+	return 0;
+}
+
+static int import_files(struct cpm_fs *fs,
+			const struct cpm_fs_import_file *files,
+			uint32_t count)
+{
+	uint32_t bs = fs->attr.block_size;
+	uint8_t per_entry = max_blocks_per_entry(fs);
+	uint64_t blocks = 0, entries = 0, n;
+	uint32_t cursor = 1, created = 0;
+	uint16_t **plan;
+	uint8_t *buf;
+	int ret;
+
+	if ((ret = ensure_checked(fs)))
+		return ret;
+
+	/* Check capacity up front, so nothing is changed when it's short */
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!files[i].name || (files[i].size && !files[i].data &&
+				       !files[i].read))
+			return CPM_ERR_INVALID_ARG;
+		n = (files[i].size + bs - 1) / bs;
+		blocks += n;
+		entries += n ? (n + per_entry - 1) / per_entry : 1;
+	}
+	if (entries > bitmap_count(fs->files.free_entries, fs->superblock.count))
+		return CPM_ERR_DIRECTORY_FULL;
+	if (blocks > fs->av_free)
+		return CPM_ERR_DISK_FULL;
+
+	plan = (uint16_t **)calloc(count, sizeof(uint16_t *));
+	buf = (uint8_t *)malloc((size_t)fs->iov_cap * fs->attr.sector_size);
+	if (!plan || !buf) {
+		ret = CPM_ERR_NOMEM;
+		goto end;
+	}
+
+	/* Create every entry first, the directory is checked for duplicate
+	 * names before any data is written */
+	for (; created < count && !ret; ++created) {
+		if (!is_valid_user(files[created].user)) {
+			ret = CPM_ERR_INVALID_USER;
+			break;
+		}
+		ret = create_file(fs, files[created].name, files[created].user);
+		if (ret)
+			break;
+		ret = import_reserve(fs, &files[created], &cursor, &plan[created]);
+	}
+
+	for (uint32_t i = 0; i < count && !ret; ++i)
+		ret = import_write(fs, &files[i], plan[i], buf);
+
+	if (!ret) {
+		ret = sync_fs(fs);
+	} else {
+		/* Nothing was written to the directory yet, forget the batch */
+		for (uint32_t i = 0; i < created; ++i)
+			unlink_file(fs, files[i].name, files[i].user);
+	}
+
+end:
+	for (uint32_t i = 0; plan && i < count; ++i)
+		free(plan[i]);
+	free(plan);
+	free(buf);
+	return ret;
+}
+
+enum cpm_fs_status cpm_fs_import(struct cpm_fs *fs,
+				 const struct cpm_fs_import_file *files,
+				 uint32_t count)
+{
+	int ret;
+
+	if (!fs || (!files && count) ||
+	    (!fs->io.write_sector && !fs->io.write_sectors &&
+	     !(fs->io.read_track && fs->io.write_track)))
+		return CPM_ERR_INVALID_ARG;
+
+	fs_lock(fs);
+	ret = import_files(fs, files, count);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
 }
 
 const char *cpm_fs_status_str(enum cpm_fs_status status)
@@ -748,6 +1752,10 @@ const char *cpm_fs_status_str(enum cpm_fs_status status)
 		return "Trying to write to a file opened as read-only";
 	case CPM_ERR_DESTINATION_EXISTS:
 		return "Trying to rename a file to a name that already exists";
+	case CPM_ERR_DIRECTORY_FULL:
+		return "Directory is full";
+	case CPM_ERR_IMAGE:
+		return "Cannot open or map disk image";
 	default:
 		return "Unknown status code";
 	}
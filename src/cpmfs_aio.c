@@ -0,0 +1,310 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "cpmfs_internal.h"
+
+/* Asynchronous requests are run by a pool of worker threads calling
+ * cpm_fs_pread and cpm_fs_pwrite. Completions are queued until the caller
+ * polls them, so callbacks always run in the caller's thread. */
+
+struct aio_req {
+	struct aio_req *next;
+	struct cpm_fs_file_handle *fh;
+	uint8_t *buf;
+	size_t count;
+	size_t offset;
+	bool write;
+	cpm_fs_aio_cb cb;
+	void *userdata;
+
+	/* Filled in by the worker */
+	enum cpm_fs_status status;
+	size_t done;
+};
+
+/* FIFO of requests */
+struct aio_queue {
+	struct aio_req *head;
+	struct aio_req *tail;
+};
+
+struct cpm_fs_aio {
+	struct cpm_fs *fs;
+	pthread_t *workers;
+	uint32_t worker_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* Requests were submitted, or stopping */
+	pthread_cond_t done; /* Requests were completed */
+	struct aio_queue pending;
+	struct aio_queue completed;
+	uint32_t outstanding; /* Submitted but not completed yet */
+	bool stop;
+};
+
+static void queue_push(struct aio_queue *q, struct aio_req *req)
+{
+	req->next = NULL;
+	if (q->tail)
+		q->tail->next = req;
+	else
+		q->head = req;
+	q->tail = req;
+}
+
+static struct aio_req *queue_pop(struct aio_queue *q)
+{
+	struct aio_req *req = q->head;
+
+	if (req) {
+		q->head = req->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return req;
+}
+
+static void aio_run(struct cpm_fs *fs, struct aio_req *req)
+{
+	if (req->write)
+		req->status = cpm_fs_pwrite(fs,
+					    req->fh,
+					    req->buf,
+					    req->count,
+					    req->offset,
+					    &req->done);
+	else
+		req->status = cpm_fs_pread(fs,
+					   req->fh,
+					   req->buf,
+					   req->count,
+					   req->offset,
+					   &req->done);
+	if (req->status)
+		req->done = 0;
+}
+
+static void *aio_worker(void *arg)
+{
+	struct cpm_fs_aio *aio = (struct cpm_fs_aio *)arg;
+	struct aio_req *req;
+
+	pthread_mutex_lock(&aio->lock);
+	for (;;) {
+		req = queue_pop(&aio->pending);
+		if (!req) {
+			/* Pending requests are still run when stopping */
+			if (aio->stop)
+				break;
+			pthread_cond_wait(&aio->work, &aio->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&aio->lock);
+		aio_run(aio->fs, req);
+		pthread_mutex_lock(&aio->lock);
+
+		queue_push(&aio->completed, req);
+		aio->outstanding--;
+		pthread_cond_broadcast(&aio->done);
+	}
+	pthread_mutex_unlock(&aio->lock);
+	return NULL;
+}
+
+/* Stop the workers once the pending requests are done */
+static void aio_stop(struct cpm_fs_aio *aio)
+{
+	pthread_mutex_lock(&aio->lock);
+	aio->stop = true;
+	pthread_cond_broadcast(&aio->work);
+	pthread_mutex_unlock(&aio->lock);
+
+	for (uint32_t i = 0; i < aio->worker_count; ++i)
+		pthread_join(aio->workers[i], NULL);
+	aio->worker_count = 0;
+}
+
+static void aio_free(struct cpm_fs_aio *aio)
+{
+	pthread_cond_destroy(&aio->done);
+	pthread_cond_destroy(&aio->work);
+	pthread_mutex_destroy(&aio->lock);
+	free(aio->workers);
+	free(aio);
+}
+
+enum cpm_fs_status
+cpm_fs_aio_new(struct cpm_fs *fs, uint32_t workers, struct cpm_fs_aio **out)
+{
+	struct cpm_fs_aio *aio;
+
+	if (!fs || !out)
+		return CPM_ERR_INVALID_ARG;
+	if (!workers)
+		workers = CPM_FS_DEFAULT_AIO_WORKERS;
+
+	aio = (struct cpm_fs_aio *)calloc(sizeof(struct cpm_fs_aio), 1);
+	if (!aio)
+		return CPM_ERR_NOMEM;
+	aio->fs = fs;
+
+	aio->workers = (pthread_t *)calloc(sizeof(pthread_t), workers);
+	if (!aio->workers) {
+		free(aio);
+		return CPM_ERR_NOMEM;
+	}
+	if (pthread_mutex_init(&aio->lock, NULL)) {
+		free(aio->workers);
+		free(aio);
+		return CPM_ERR_NOMEM;
+	}
+	if (pthread_cond_init(&aio->work, NULL)) {
+		pthread_mutex_destroy(&aio->lock);
+		free(aio->workers);
+		free(aio);
+		return CPM_ERR_NOMEM;
+	}
+	if (pthread_cond_init(&aio->done, NULL)) {
+		pthread_cond_destroy(&aio->work);
+		pthread_mutex_destroy(&aio->lock);
+		free(aio->workers);
+		free(aio);
+		return CPM_ERR_NOMEM;
+	}
+
+	for (; aio->worker_count < workers; ++aio->worker_count) {
+		if (pthread_create(&aio->workers[aio->worker_count],
+				   NULL,
+				   aio_worker,
+				   aio)) {
+			aio_stop(aio);
+			aio_free(aio);
+			return CPM_ERR_NOMEM;
+		}
+	}
+
+	*out = aio;
+	return CPM_SUCCESS;
+}
+
+static enum cpm_fs_status aio_submit(struct cpm_fs_aio *aio,
+				     struct cpm_fs_file_handle *fh,
+				     uint8_t *buf,
+				     size_t count,
+				     size_t offset,
+				     bool write,
+				     cpm_fs_aio_cb cb,
+				     void *userdata)
+{
+	struct aio_req *req;
+
+	if (!aio || !fh || !buf || count == 0)
+		return CPM_ERR_INVALID_ARG;
+
+	req = (struct aio_req *)calloc(sizeof(struct aio_req), 1);
+	if (!req)
+		return CPM_ERR_NOMEM;
+	req->fh = fh;
+	req->buf = buf;
+	req->count = count;
+	req->offset = offset;
+	req->write = write;
+	req->cb = cb;
+	req->userdata = userdata;
+
+	pthread_mutex_lock(&aio->lock);
+	queue_push(&aio->pending, req);
+	aio->outstanding++;
+	pthread_cond_signal(&aio->work);
+	pthread_mutex_unlock(&aio->lock);
+	return CPM_SUCCESS;
+}
+
+enum cpm_fs_status cpm_fs_read_async(struct cpm_fs_aio *aio,
+				     struct cpm_fs_file_handle *file,
+				     uint8_t *buf,
+				     size_t count,
+				     size_t offset,
+				     cpm_fs_aio_cb cb,
+				     void *userdata)
+{
+	return aio_submit(aio, file, buf, count, offset, false, cb, userdata);
+}
+
+enum cpm_fs_status cpm_fs_write_async(struct cpm_fs_aio *aio,
+				      struct cpm_fs_file_handle *file,
+				      uint8_t *buf,
+				      size_t count,
+				      size_t offset,
+				      cpm_fs_aio_cb cb,
+				      void *userdata)
+{
+	return aio_submit(aio, file, buf, count, offset, true, cb, userdata);
+}
+
+/* Call the callbacks of the completed requests, and free them */
+static uint32_t aio_complete(struct aio_req *req)
+{
+	struct aio_req *next;
+	uint32_t count = 0;
+
+	for (; req; req = next, ++count) {
+		next = req->next;
+		if (req->cb)
+			req->cb(req->userdata, req->status, req->done);
+		free(req);
+	}
+	return count;
+}
+
+enum cpm_fs_status cpm_fs_aio_poll(struct cpm_fs_aio *aio,
+				   uint32_t min_complete,
+				   uint32_t *out_count)
+{
+	struct aio_req *done;
+	uint32_t available;
+	uint32_t count = 0;
+
+	if (!aio)
+		return CPM_ERR_INVALID_ARG;
+
+	do {
+		pthread_mutex_lock(&aio->lock);
+		for (;;) {
+			available = 0;
+			for (done = aio->completed.head; done; done = done->next)
+				available++;
+			/* Don't wait for requests that were never submitted */
+			if (count + available >= min_complete ||
+			    !aio->outstanding)
+				break;
+			pthread_cond_wait(&aio->done, &aio->lock);
+		}
+		done = aio->completed.head;
+		aio->completed.head = NULL;
+		aio->completed.tail = NULL;
+		pthread_mutex_unlock(&aio->lock);
+
+		/* Callbacks may submit new requests */
+		count += aio_complete(done);
+	} while (count < min_complete && done);
+
+	if (out_count)
+		*out_count = count;
+	return CPM_SUCCESS;
+}
+
+enum cpm_fs_status cpm_fs_aio_destroy(struct cpm_fs_aio *aio)
+{
+	if (!aio)
+		return CPM_ERR_INVALID_ARG;
+
+	aio_stop(aio);
+	aio_complete(aio->completed.head);
+	aio_free(aio);
+	return CPM_SUCCESS;
+}
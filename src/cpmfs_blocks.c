@@ -0,0 +1,27 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include "cpmfs_internal.h"
+
+/* Both addressing modes are built from the same template, so loops over
+ * block pointers don't have to check the mode. */
+
+#define BLK_NAME(x) blocks8_##x
+#define BLK_PTRS 16
+#include "cpmfs_blocks_tmpl.h"
+#undef BLK_NAME
+#undef BLK_PTRS
+
+#define BLK_NAME(x) blocks16_##x
+#define BLK_PTRS 8
+#include "cpmfs_blocks_tmpl.h"
+#undef BLK_NAME
+#undef BLK_PTRS
+
+void set_block_addressing(struct cpm_fs *fs,
+			  enum cpm_fs_block_addressing addressing)
+{
+	fs->block_addressing = addressing;
+	fs->blk = (addressing == CPM_BLOCK_ADDR_8) ? &blocks8_ops :
+						     &blocks16_ops;
+}
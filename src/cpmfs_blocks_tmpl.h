@@ -0,0 +1,64 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+/* Block pointer accessors for one addressing mode. Included by
+ * cpmfs_blocks.c with BLK_NAME(x), giving the function names, and BLK_PTRS,
+ * the number of pointers in an entry (16 or 8). No include guard. */
+
+static inline uint16_t BLK_NAME(get)(const cpm_entry *entry, uint32_t i)
+{
+#if BLK_PTRS == 16
+	return entry->block_ptr[i];
+#else
+	/* Little endian on disk, whatever the host is */
+	return (uint16_t)(entry->block_ptr[2 * i] |
+			  (entry->block_ptr[2 * i + 1] << 8));
+#endif
+}
+
+static void BLK_NAME(decode)(const cpm_entry *entry, uint16_t *out)
+{
+	for (uint32_t i = 0; i < BLK_PTRS; ++i)
+		out[i] = BLK_NAME(get)(entry, i);
+}
+
+static uint8_t BLK_NAME(used)(const cpm_entry *entry)
+{
+	uint8_t count = 0;
+
+	for (uint32_t i = 0; i < BLK_PTRS; ++i)
+		count += BLK_NAME(get)(entry, i) != 0;
+	return count;
+}
+
+static uint16_t BLK_NAME(last)(const cpm_entry *entry)
+{
+	for (int i = BLK_PTRS - 1; i >= 0; --i)
+		if (BLK_NAME(get)(entry, (uint32_t)i))
+			return BLK_NAME(get)(entry, (uint32_t)i);
+	return 0;
+}
+
+static bool BLK_NAME(is_last)(const cpm_entry *entry, uint16_t idx)
+{
+	return idx == BLK_PTRS - 1 || BLK_NAME(get)(entry, idx + 1u) == 0;
+}
+
+static void BLK_NAME(set)(cpm_entry *entry, uint8_t idx, uint16_t block)
+{
+#if BLK_PTRS == 16
+	entry->block_ptr[idx] = (uint8_t)block;
+#else
+	entry->block_ptr[2 * idx] = (uint8_t)(block & 0xFF);
+	entry->block_ptr[2 * idx + 1] = (uint8_t)(block >> 8);
+#endif
+}
+
+static const struct cpm_block_ops BLK_NAME(ops) = {
+	BLK_PTRS,
+	BLK_NAME(decode),
+	BLK_NAME(used),
+	BLK_NAME(last),
+	BLK_NAME(is_last),
+	BLK_NAME(set),
+};
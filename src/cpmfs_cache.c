@@ -0,0 +1,434 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpmfs_internal.h"
+
+/* Sector number from the start of the disk, unique for a given geometry */
+static uint32_t sector_key(struct cpm_fs *fs,
+			   uint32_t c,
+			   uint32_t h,
+			   uint32_t s)
+{
+	return (c * fs->attr.heads + h) * fs->attr.sector_count + s;
+}
+
+static uint32_t *cache_bucket(struct cpm_sector_cache *cache, uint32_t key)
+{
+	return &cache->buckets[(key * 2654435761u) & cache->bucket_mask];
+}
+
+static uint8_t *slot_data(struct cpm_fs *fs, uint32_t slot)
+{
+	return fs->cache.data + (size_t)slot * fs->attr.sector_size;
+}
+
+static void lru_unlink(struct cpm_sector_cache *cache, uint32_t slot)
+{
+	struct cpm_cache_slot *e = &cache->slots[slot];
+
+	if (e->prev != CPM_NO_ENTRY)
+		cache->slots[e->prev].next = e->next;
+	else
+		cache->head = e->next;
+	if (e->next != CPM_NO_ENTRY)
+		cache->slots[e->next].prev = e->prev;
+	else
+		cache->tail = e->prev;
+}
+
+static void lru_push_front(struct cpm_sector_cache *cache, uint32_t slot)
+{
+	struct cpm_cache_slot *e = &cache->slots[slot];
+
+	e->prev = CPM_NO_ENTRY;
+	e->next = cache->head;
+	if (cache->head != CPM_NO_ENTRY)
+		cache->slots[cache->head].prev = slot;
+	cache->head = slot;
+	if (cache->tail == CPM_NO_ENTRY)
+		cache->tail = slot;
+}
+
+static void lru_push_back(struct cpm_sector_cache *cache, uint32_t slot)
+{
+	struct cpm_cache_slot *e = &cache->slots[slot];
+
+	e->next = CPM_NO_ENTRY;
+	e->prev = cache->tail;
+	if (cache->tail != CPM_NO_ENTRY)
+		cache->slots[cache->tail].next = slot;
+	cache->tail = slot;
+	if (cache->head == CPM_NO_ENTRY)
+		cache->head = slot;
+}
+
+/* Return the slot holding key, or CPM_NO_ENTRY */
+static uint32_t cache_find(struct cpm_sector_cache *cache, uint32_t key)
+{
+	uint32_t slot = *cache_bucket(cache, key);
+
+	while (slot != CPM_NO_ENTRY && cache->slots[slot].key != key)
+		slot = cache->slots[slot].hash_next;
+	return slot;
+}
+
+/* Empty a slot and make it the next one to be reused */
+static void cache_drop(struct cpm_sector_cache *cache, uint32_t slot)
+{
+	struct cpm_cache_slot *e = &cache->slots[slot];
+	uint32_t *link;
+
+	if (e->key != CPM_NO_ENTRY) {
+		link = cache_bucket(cache, e->key);
+		while (*link != slot)
+			link = &cache->slots[*link].hash_next;
+		*link = e->hash_next;
+		e->key = CPM_NO_ENTRY;
+	}
+	lru_unlink(cache, slot);
+	lru_push_back(cache, slot);
+}
+
+/* Give the least recently used slot to key, contents are left as is */
+static uint32_t cache_take(struct cpm_sector_cache *cache, uint32_t key)
+{
+	uint32_t slot = cache->tail;
+	uint32_t *bucket;
+
+	cache_drop(cache, slot);
+	cache->slots[slot].key = key;
+	bucket = cache_bucket(cache, key);
+	cache->slots[slot].hash_next = *bucket;
+	*bucket = slot;
+
+	lru_unlink(cache, slot);
+	lru_push_front(cache, slot);
+	return slot;
+}
+
+/* Take a slot for key and keep it out of the LRU list while it's read
+ * without the lock */
+static uint32_t cache_reserve(struct cpm_sector_cache *cache, uint32_t key)
+{
+	uint32_t slot = cache_take(cache, key);
+
+	lru_unlink(cache, slot);
+	cache->slots[slot].loading = true;
+	return slot;
+}
+
+/* Put back a reserved slot, emptied if it couldn't be read */
+static void cache_publish(struct cpm_fs *fs, uint32_t slot, bool ok)
+{
+	fs->cache.slots[slot].loading = false;
+	lru_push_front(&fs->cache, slot);
+	if (!ok)
+		cache_drop(&fs->cache, slot);
+	pthread_cond_broadcast(&fs->cache_cond);
+}
+
+/* Find key, waiting for it if it's being loaded. Called with the lock. */
+static uint32_t cache_wait(struct cpm_fs *fs, uint32_t key)
+{
+	uint32_t slot;
+
+	while ((slot = cache_find(&fs->cache, key)) != CPM_NO_ENTRY &&
+	       fs->cache.slots[slot].loading)
+		pthread_cond_wait(&fs->cache_cond, &fs->cache_lock);
+	return slot;
+}
+
+int disk_read(struct cpm_fs *fs, struct cpm_fs_sector_io *io, uint32_t count)
+{
+	if (!count)
+		return 0;
+
+	if (fs->io.read_track)
+		return track_read(fs, io, count);
+
+	if (fs->io.read_sectors)
+		return fs->io.read_sectors(fs->userdata, io, count) ?
+			       CPM_ERR_SECTOR_READ :
+			       0;
+
+	for (uint32_t i = 0; i < count; ++i)
+		if (fs->io.read_sector(fs->userdata,
+				       io[i].cylinder,
+				       io[i].head,
+				       io[i].sector,
+				       io[i].buf))
+			return CPM_ERR_SECTOR_READ;
+	return 0;
+}
+
+int disk_write(struct cpm_fs *fs,
+	       const struct cpm_fs_sector_io *io,
+	       uint32_t count)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	uint32_t slot;
+	int ret = 0;
+
+	if (!count)
+		return 0;
+
+	if (fs->io.read_track && fs->io.write_track) {
+		ret = track_write(fs, io, count);
+	} else if (fs->io.write_sectors) {
+		ret = fs->io.write_sectors(fs->userdata, io, count);
+	} else if (fs->io.write_sector) {
+		for (uint32_t i = 0; i < count && !ret; ++i)
+			ret = fs->io.write_sector(fs->userdata,
+						  io[i].cylinder,
+						  io[i].head,
+						  io[i].sector,
+						  io[i].buf);
+	} else {
+		ret = 1;
+	}
+
+	if (!ret && fs->io.read_track && !fs->io.write_track)
+		track_update(fs, io, count);
+
+	/* Update cached copies. On error, drop them as the disk contents are
+	 * unknown. */
+	for (uint32_t i = 0; i < count; ++i) {
+		slot = cache_find(cache,
+				  sector_key(fs,
+					     io[i].cylinder,
+					     io[i].head,
+					     io[i].sector));
+		if (slot == CPM_NO_ENTRY)
+			continue;
+		if (ret)
+			cache_drop(cache, slot);
+		else if (slot_data(fs, slot) != io[i].buf)
+			memcpy(slot_data(fs, slot),
+			       io[i].buf,
+			       fs->attr.sector_size);
+	}
+
+	return ret ? CPM_ERR_SECTOR_WRITE : 0;
+}
+
+int cache_init(struct cpm_fs *fs)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	uint32_t buckets = 1;
+
+	cache->capacity = fs->attr.cache_sectors;
+	if (!cache->capacity)
+		cache->capacity = CPM_FS_DEFAULT_CACHE_SECTORS;
+	while (buckets < cache->capacity * 2)
+		buckets <<= 1;
+	cache->bucket_mask = buckets - 1;
+
+	cache->data = (uint8_t *)malloc((size_t)cache->capacity *
+					fs->attr.sector_size);
+	cache->slots = (struct cpm_cache_slot *)malloc(
+		cache->capacity * sizeof(struct cpm_cache_slot));
+	cache->buckets = (uint32_t *)malloc(buckets * sizeof(uint32_t));
+	if (!cache->data || !cache->slots || !cache->buckets)
+		return CPM_ERR_NOMEM;
+
+	if (pthread_mutex_init(&fs->cache_lock, NULL))
+		return CPM_ERR_NOMEM;
+	if (pthread_cond_init(&fs->cache_cond, NULL)) {
+		pthread_mutex_destroy(&fs->cache_lock);
+		return CPM_ERR_NOMEM;
+	}
+	fs->cache_lock_init = true;
+
+	memset(cache->buckets, 0xFF, buckets * sizeof(uint32_t));
+	cache->head = CPM_NO_ENTRY;
+	cache->tail = CPM_NO_ENTRY;
+	for (uint32_t i = 0; i < cache->capacity; ++i) {
+		cache->slots[i].key = CPM_NO_ENTRY;
+		cache->slots[i].hash_next = CPM_NO_ENTRY;
+		cache->slots[i].loading = false;
+		lru_push_back(cache, i);
+	}
+	return 0;
+}
+
+void cache_free(struct cpm_fs *fs)
+{
+	if (fs->cache_lock_init) {
+		pthread_cond_destroy(&fs->cache_cond);
+		pthread_mutex_destroy(&fs->cache_lock);
+	}
+	free(fs->cache.data);
+	free(fs->cache.slots);
+	free(fs->cache.buckets);
+}
+
+int cache_read(struct cpm_fs *fs,
+	       uint32_t c,
+	       uint32_t h,
+	       uint32_t s,
+	       uint8_t **out_sector)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	uint32_t key = sector_key(fs, c, h, s);
+	uint32_t slot;
+
+	slot = cache_find(cache, key);
+	if (slot != CPM_NO_ENTRY) {
+		lru_unlink(cache, slot);
+		lru_push_front(cache, slot);
+	} else {
+		struct cpm_fs_sector_io io = { c, h, s, NULL };
+
+		slot = cache_take(cache, key);
+		io.buf = slot_data(fs, slot);
+		if (disk_read(fs, &io, 1)) {
+			cache_drop(cache, slot);
+			return CPM_ERR_SECTOR_READ;
+		}
+	}
+
+	*out_sector = slot_data(fs, slot);
+	return 0;
+}
+
+bool cache_copy(struct cpm_fs *fs,
+		uint32_t c,
+		uint32_t h,
+		uint32_t s,
+		uint8_t *buf)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	uint32_t slot;
+
+	pthread_mutex_lock(&fs->cache_lock);
+	slot = cache_wait(fs, sector_key(fs, c, h, s));
+	if (slot != CPM_NO_ENTRY) {
+		lru_unlink(cache, slot);
+		lru_push_front(cache, slot);
+		memcpy(buf, slot_data(fs, slot), fs->attr.sector_size);
+	}
+	pthread_mutex_unlock(&fs->cache_lock);
+	return slot != CPM_NO_ENTRY;
+}
+
+int cache_read_part(struct cpm_fs *fs,
+		    uint32_t c,
+		    uint32_t h,
+		    uint32_t s,
+		    uint8_t *buf,
+		    uint32_t offset,
+		    uint32_t count)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	struct cpm_fs_sector_io io = { c, h, s, NULL };
+	uint32_t key = sector_key(fs, c, h, s);
+	uint32_t slot;
+	int ret = 0;
+
+	pthread_mutex_lock(&fs->cache_lock);
+	for (;;) {
+		slot = cache_wait(fs, key);
+		if (slot != CPM_NO_ENTRY) {
+			lru_unlink(cache, slot);
+			lru_push_front(cache, slot);
+			break;
+		}
+		/* Every slot is being loaded */
+		if (cache->tail == CPM_NO_ENTRY) {
+			pthread_cond_wait(&fs->cache_cond, &fs->cache_lock);
+			continue;
+		}
+
+		slot = cache_reserve(cache, key);
+		io.buf = slot_data(fs, slot);
+		pthread_mutex_unlock(&fs->cache_lock);
+		ret = disk_read(fs, &io, 1);
+		pthread_mutex_lock(&fs->cache_lock);
+		cache_publish(fs, slot, !ret);
+		break;
+	}
+	if (!ret)
+		memcpy(buf, slot_data(fs, slot) + offset, count);
+	pthread_mutex_unlock(&fs->cache_lock);
+	return ret;
+}
+
+int cache_prefetch(struct cpm_fs *fs,
+		   struct cpm_fs_sector_io *io,
+		   uint32_t count)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	uint32_t key, n = 0;
+	int ret;
+
+	pthread_mutex_lock(&fs->cache_lock);
+	/* Stops when every slot is being loaded */
+	for (uint32_t i = 0; i < count && cache->tail != CPM_NO_ENTRY; ++i) {
+		key = sector_key(fs, io[i].cylinder, io[i].head, io[i].sector);
+		if (cache_find(cache, key) != CPM_NO_ENTRY)
+			continue;
+		io[n] = io[i];
+		io[n].buf = slot_data(fs, cache_reserve(cache, key));
+		n++;
+	}
+	pthread_mutex_unlock(&fs->cache_lock);
+
+	ret = disk_read(fs, io, n);
+
+	pthread_mutex_lock(&fs->cache_lock);
+	for (uint32_t i = 0; i < n; ++i)
+		cache_publish(fs,
+			      (uint32_t)(io[i].buf - cache->data) /
+				      fs->attr.sector_size,
+			      !ret);
+	pthread_mutex_unlock(&fs->cache_lock);
+	return ret;
+}
+
+int cache_write(struct cpm_fs *fs,
+		uint32_t c,
+		uint32_t h,
+		uint32_t s,
+		const uint8_t *buf,
+		uint32_t offset,
+		uint32_t count,
+		bool keep)
+{
+	struct cpm_sector_cache *cache = &fs->cache;
+	struct cpm_fs_sector_io io = { c, h, s, (uint8_t *)buf };
+	uint32_t key = sector_key(fs, c, h, s);
+	uint32_t ss = fs->attr.sector_size;
+	uint8_t *sector;
+	uint32_t slot;
+	int ret;
+
+	if (offset + count > ss)
+		return CPM_ERR_INVALID_ARG;
+
+	/* Whole sector, only update the cached copy if any */
+	if (offset == 0 && count == ss)
+		return disk_write(fs, &io, 1);
+
+	slot = cache_find(cache, key);
+
+	if (slot != CPM_NO_ENTRY) {
+		sector = slot_data(fs, slot);
+		lru_unlink(cache, slot);
+		lru_push_front(cache, slot);
+	} else if (keep) {
+		if ((ret = cache_read(fs, c, h, s, &sector)))
+			return ret;
+		slot = cache_find(cache, key);
+	} else {
+		slot = cache_take(cache, key);
+		sector = slot_data(fs, slot);
+		memset(sector, 0xE5, ss);
+	}
+
+	memcpy(sector + offset, buf, count);
+	io.buf = sector;
+	return disk_write(fs, &io, 1);
+}
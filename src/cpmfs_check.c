@@ -7,54 +7,6 @@
 #include "cpmfs_internal.h"
 #include "libcpmfs.h"
 
-/* Check for blocks out of bounds */
-static int check_block_validity(struct cpm_fs *fs, cpm_entry *file)
-{
-	uint32_t max_blocks, dir_blocks;
-
-	/* Maximum block number. disk_size excludes reserved cylinders */
-	max_blocks = fs->disk_size / fs->attr.block_size;
-
-	/* Number of blocks reserved for directory table */
-	dir_blocks = (fs->attr.max_dir_entries * 32) / fs->attr.block_size;
-	if ((fs->attr.max_dir_entries * 32) % fs->attr.block_size)
-		dir_blocks += 1;
-
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8) {
-		for (int i = 0; i < 16; ++i) {
-			if (file->block_ptr[i] > max_blocks)
-				return CPM_ERR_BLOCK_OVERFLOW;
-			else if (file->block_ptr[i] &&
-				 file->block_ptr[i] <= dir_blocks - 1) {
-				return CPM_ERR_FILE_DIR_OVERLAP;
-			}
-		}
-	} else {
-		for (int i = 0; i < 8; ++i) {
-			if (file->block_ptr_w[i] > max_blocks)
-				return CPM_ERR_BLOCK_OVERFLOW;
-			else if (file->block_ptr_w[i] &&
-				 file->block_ptr_w[i] <= dir_blocks - 1)
-				return CPM_ERR_FILE_DIR_OVERLAP;
-		}
-	}
-	return 0;
-}
-
-static int qsort_comparator(const void *a, const void *b)
-{
-	uint8_t f = *((uint8_t *)a);
-	uint8_t s = *((uint8_t *)b);
-	return (f > s ? 1 : (f < s) ? -1 : 0);
-}
-
-static int qsort_comparator_w(const void *a, const void *b)
-{
-	uint16_t f = *((uint16_t *)a);
-	uint16_t s = *((uint16_t *)b);
-	return (f > s ? 1 : (f < s) ? -1 : 0);
-}
-
 bool cpm_entry_is_valid(const cpm_entry *entry)
 {
 	int i;
@@ -73,77 +25,149 @@ bool cpm_entry_is_valid(const cpm_entry *entry)
 	return true;
 }
 
-/* Check for multiple files using the same block */
-static int check_extent_overlap_wide(struct cpm_fs *fs)
+struct check_state {
+	struct cpm_fs *fs;
+	struct cpm_fs_check_report *report;
+	uint32_t report_cap;
+	/* Entry owning each block, only kept when building a report */
+	uint32_t *owner;
+	uint32_t dir_blocks;
+	int status;
+};
+
+static int report_conflict(struct check_state *st,
+			   int type,
+			   uint32_t block,
+			   uint32_t entry_idx)
 {
-	uint16_t *extent_list;
-	uint32_t i;
-	int ret = 0;
-
-	extent_list = (uint16_t *)calloc(fs->attr.max_dir_entries * 8, 2);
-	if (!extent_list)
-		return CPM_ERR_NOMEM;
-
-	/* Fill table with valid file extents */
-	for (i = 0; i < fs->attr.max_dir_entries; ++i)
-		if (cpm_entry_is_valid(&fs->superblock.entries[i]))
-			memcpy(((uint8_t *)extent_list) + i * 16,
-			       fs->superblock.entries[i].block_ptr,
-			       16);
-
-	qsort(extent_list, fs->attr.max_dir_entries * 8, 2, qsort_comparator_w);
-	for (i = 0; i < fs->attr.max_dir_entries * 8 - 1; ++i)
-		if (extent_list[i] && extent_list[i] == extent_list[i + 1])
-			ret = CPM_ERR_FILE_OVERLAP;
+	struct cpm_fs_check_report *report = st->report;
+	struct cpm_fs_conflict *conflict;
+	cpm_entry *entry;
+
+	if (report->count == st->report_cap) {
+		uint32_t cap = st->report_cap ? st->report_cap * 2 : 16;
+		conflict = (struct cpm_fs_conflict *)realloc(
+			report->conflicts, cap * sizeof(*conflict));
+		if (!conflict)
+			return CPM_ERR_NOMEM;
+		report->conflicts = conflict;
+		st->report_cap = cap;
+	}
 
-	free(extent_list);
-	return ret;
+	conflict = &report->conflicts[report->count++];
+	memset(conflict, 0, sizeof(*conflict));
+	conflict->type = (enum cpm_fs_status)type;
+	conflict->block = block;
+
+	entry = &st->fs->superblock.entries[entry_idx];
+	conflict->entry = entry_idx;
+	conflict->user = entry->status & 0x0F;
+	entry_get_name(entry, conflict->name);
+
+	conflict->other_entry = CPM_NO_ENTRY;
+	if (type == CPM_ERR_FILE_OVERLAP) {
+		entry = &st->fs->superblock.entries[st->owner[block]];
+		conflict->other_entry = st->owner[block];
+		conflict->other_user = entry->status & 0x0F;
+		entry_get_name(entry, conflict->other_name);
+	}
+	return 0;
 }
 
-static int check_extent_overlap(struct cpm_fs *fs)
+static int
+check_block(struct check_state *st, uint32_t entry_idx, uint32_t block)
 {
-	uint8_t *extent_list;
-	uint32_t i;
-	int ret = 0;
-
-	extent_list = (uint8_t *)calloc(16 * fs->superblock.count + 1, 1);
-	if (!extent_list)
-		return CPM_ERR_NOMEM;
-
-	/* Copy and sort all the extent numbers to check for overlaps */
-	for (i = 0; i < fs->superblock.count; ++i)
-		if (cpm_entry_is_valid(&fs->superblock.entries[i]))
-			memcpy(extent_list + i * 16,
-			       fs->superblock.entries[i].block_ptr,
-			       16);
+	struct cpm_fs *fs = st->fs;
+	int type;
+
+	if (!block)
+		return 0;
+
+	if (block >= fs->av_blocks) {
+		type = CPM_ERR_BLOCK_OVERFLOW;
+	} else if (block < st->dir_blocks) {
+		type = CPM_ERR_FILE_DIR_OVERLAP;
+	} else if (av_get(fs, block)) {
+		type = CPM_ERR_FILE_OVERLAP;
+	} else {
+		av_set(fs, block);
+		if (st->owner)
+			st->owner[block] = entry_idx;
+		return 0;
+	}
 
-	qsort(extent_list, fs->superblock.count * 16, 1, qsort_comparator);
-	for (i = 0; i < fs->superblock.count * 16; ++i)
-		if (extent_list[i] && extent_list[i] == extent_list[i + 1])
-			ret = CPM_ERR_FILE_OVERLAP;
+	/* Out of range blocks take precedence over overlapping files */
+	if (!st->status || (st->status == CPM_ERR_FILE_OVERLAP &&
+			    type != CPM_ERR_FILE_OVERLAP))
+		st->status = type;
 
-	free(extent_list);
-	return ret;
+	if (st->report)
+		return report_conflict(st, type, block, entry_idx);
+	return 0;
 }
 
-int check_superblock(struct cpm_fs *fs)
+int check_superblock(struct cpm_fs *fs, struct cpm_fs_check_report *report)
 {
-	uint32_t i = 0;
+	struct check_state st;
+	cpm_entry *entry;
+	uint16_t blocks[16];
+	uint8_t count;
 	int ret = 0;
 
-	for (i = 0; i < fs->attr.max_dir_entries; ++i) {
-		if (!cpm_entry_is_valid(&(fs->superblock.entries[i])))
+	memset(&st, 0, sizeof(st));
+	st.fs = fs;
+	st.report = report;
+	st.dir_blocks = (fs->attr.max_dir_entries * sizeof(cpm_entry) +
+			 fs->attr.block_size - 1) /
+			fs->attr.block_size;
+
+	if (report) {
+		st.owner = (uint32_t *)malloc(
+			(fs->av_blocks ? fs->av_blocks : 1) * sizeof(uint32_t));
+		if (!st.owner)
+			return CPM_ERR_NOMEM;
+	}
+
+	/* Single pass over the directory: the allocation vector doubles as
+	 * the set of blocks already seen. */
+	for (uint32_t i = 0; i < fs->superblock.count && !ret; ++i) {
+		entry = &fs->superblock.entries[i];
+		if (!cpm_entry_is_valid(entry))
 			continue;
 
-		ret = check_block_validity(fs, &(fs->superblock.entries[i]));
-		if (ret)
-			return ret;
+		count = entry_get_blocks(fs, entry, blocks);
+		for (uint8_t j = 0; j < count && !ret; ++j)
+			ret = check_block(&st, i, blocks[j]);
+
+		/* Nothing more to learn when mounting */
+		if (!report && st.status && st.status != CPM_ERR_FILE_OVERLAP)
+			break;
 	}
 
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8)
-		ret = check_extent_overlap(fs);
-	else
-		ret = check_extent_overlap_wide(fs);
+	free(st.owner);
+	if (ret)
+		return ret;
+	if (report)
+		report->status = (enum cpm_fs_status)st.status;
+	return st.status;
+}
 
+int ensure_checked(struct cpm_fs *fs)
+{
+	int ret;
+
+	if (fs->av)
+		return 0;
+
+	ret = av_init(fs);
+	if (!ret)
+		ret = check_superblock(fs, NULL);
+	if (ret) {
+		/* Try again next time */
+		free(fs->av);
+		free(fs->av_breaks);
+		fs->av = NULL;
+		fs->av_breaks = NULL;
+	}
 	return ret;
 }
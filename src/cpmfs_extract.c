@@ -0,0 +1,200 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpmfs_internal.h"
+
+void free_plan(struct plan_file *files, uint32_t count)
+{
+	if (!files)
+		return;
+	for (uint32_t i = 0; i < count; ++i)
+		free(files[i].blocks);
+	free(files);
+}
+
+int plan_files(struct cpm_fs *fs,
+	       struct plan_file **out_files,
+	       uint32_t *out_count)
+{
+	struct cpm_fs_file_handle fh;
+	struct plan_file *files;
+	uint32_t count = 0;
+	int ret;
+
+	/* A file uses at least one entry */
+	files = (struct plan_file *)calloc(
+		fs->superblock.count ? fs->superblock.count : 1,
+		sizeof(struct plan_file));
+	if (!files)
+		return CPM_ERR_NOMEM;
+
+	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
+		if (!cpm_entry_is_valid(&fs->superblock.entries[i]) ||
+		    !entry_is_first_extent(fs, i))
+			continue;
+
+		memset(&fh, 0, sizeof(fh));
+		fh.entry = i;
+		ret = build_block_map(fs, &fh);
+		free(fh.entries);
+		if (ret) {
+			free(fh.blocks);
+			free_plan(files, count);
+			return ret;
+		}
+
+		get_file_info(fs, i, &files[count].info);
+		files[count].blocks = fh.blocks;
+		files[count].block_count = fh.block_count;
+		files[count].last_block_size = fh.last_block_size;
+		if (fh.block_count)
+			files[count].size =
+				(size_t)(fh.block_count - 1) *
+					fs->attr.block_size +
+				fh.last_block_size;
+		count++;
+	}
+
+	*out_files = files;
+	*out_count = count;
+	return 0;
+}
+
+/* Work shared by the threads of cpm_fs_extract_all */
+struct extract_job {
+	struct cpm_fs *fs;
+	struct plan_file *files;
+	uint32_t count;
+	cpm_fs_sink_cb sink;
+	void *userdata;
+
+	pthread_mutex_t lock;
+	uint32_t next; /* Next file to extract */
+	int error; /* First error, stops every thread */
+};
+
+/* Read a whole file into buf and give it to the sink */
+static int extract_file(struct extract_job *job,
+			struct plan_file *file,
+			struct cpm_fs_sector_io *iov,
+			uint8_t *buf)
+{
+	uint32_t block_size = job->fs->attr.block_size;
+	uint32_t len;
+	int ret;
+
+	for (uint32_t i = 0; i < file->block_count; ++i) {
+		len = i == file->block_count - 1 ? file->last_block_size :
+						   block_size;
+		ret = read_block(job->fs,
+				 iov,
+				 file->blocks[i],
+				 buf + (size_t)i * block_size,
+				 0,
+				 len);
+		if (ret)
+			return ret;
+	}
+	return job->sink(job->userdata, &file->info, buf, file->size);
+}
+
+static void *extract_worker(void *arg)
+{
+	struct extract_job *job = (struct extract_job *)arg;
+	struct cpm_fs_sector_io *iov;
+	struct plan_file *file;
+	uint8_t *buf = NULL, *tmp;
+	size_t buf_size = 0;
+	int ret = 0;
+
+	iov = (struct cpm_fs_sector_io *)calloc(job->fs->iov_cap,
+						sizeof(struct cpm_fs_sector_io));
+	if (!iov)
+		ret = CPM_ERR_NOMEM;
+
+	while (!ret) {
+		pthread_mutex_lock(&job->lock);
+		if (job->error || job->next == job->count) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		file = &job->files[job->next++];
+		pthread_mutex_unlock(&job->lock);
+
+		/* Whole blocks are read, the buffer holds the last one too */
+		if ((size_t)file->block_count * job->fs->attr.block_size >
+		    buf_size) {
+			buf_size = (size_t)file->block_count *
+				   job->fs->attr.block_size;
+			tmp = (uint8_t *)realloc(buf, buf_size);
+			if (!tmp) {
+				ret = CPM_ERR_NOMEM;
+				break;
+			}
+			buf = tmp;
+		}
+		ret = extract_file(job, file, iov, buf);
+	}
+
+	if (ret) {
+		pthread_mutex_lock(&job->lock);
+		if (!job->error)
+			job->error = ret;
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(buf);
+	free(iov);
+	return NULL;
+}
+
+enum cpm_fs_status cpm_fs_extract_all(struct cpm_fs *fs,
+				      uint32_t workers,
+				      cpm_fs_sink_cb sink,
+				      void *userdata)
+{
+	struct extract_job job;
+	pthread_t *threads;
+	uint32_t started = 0;
+	int ret;
+
+	if (!fs || !sink)
+		return CPM_ERR_INVALID_ARG;
+
+	memset(&job, 0, sizeof(job));
+	job.fs = fs;
+	job.sink = sink;
+	job.userdata = userdata;
+	if (pthread_mutex_init(&job.lock, NULL))
+		return CPM_ERR_NOMEM;
+
+	/* The calling thread is one of the workers */
+	threads = NULL;
+	if (workers > 1)
+		threads = (pthread_t *)calloc(workers - 1, sizeof(pthread_t));
+
+	fs_lock_shared(fs);
+	ret = plan_files(fs, &job.files, &job.count);
+	if (!ret) {
+		/* Fewer threads when they can't be created */
+		for (; threads && started < workers - 1; ++started)
+			if (pthread_create(&threads[started],
+					   NULL,
+					   extract_worker,
+					   &job))
+				break;
+		extract_worker(&job);
+		for (uint32_t i = 0; i < started; ++i)
+			pthread_join(threads[i], NULL);
+		ret = job.error;
+		free_plan(job.files, job.count);
+	}
+	fs_unlock(fs);
+
+	free(threads);
+	pthread_mutex_destroy(&job.lock);
+	return (enum cpm_fs_status)ret;
+}
@@ -0,0 +1,269 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpmfs_internal.h"
+
+struct cpm_image {
+	uint8_t *data; /* NULL with io_uring */
+	size_t size;
+	int fd;
+	uint32_t flags;
+	struct cpm_uring *ring; /* With CPM_FS_IMAGE_URING only */
+
+	uint32_t cylinders;
+	uint32_t heads;
+	uint32_t sector_count;
+	uint32_t sector_size;
+};
+
+/* Offset of a sector in the image, false if outside the image */
+static bool image_offset(struct cpm_image *img,
+			 uint32_t c,
+			 uint32_t h,
+			 uint32_t s,
+			 size_t *out)
+{
+	size_t track;
+
+	if (img->flags & CPM_FS_IMAGE_SIDES)
+		track = (size_t)h * img->cylinders + c;
+	else
+		track = (size_t)c * img->heads + h;
+
+	*out = (track * img->sector_count + s) * img->sector_size;
+	return *out + img->sector_size <= img->size;
+}
+
+/* Location of a sector in the mapping, NULL if outside the image */
+static uint8_t *
+image_sector(struct cpm_image *img, uint32_t c, uint32_t h, uint32_t s)
+{
+	size_t offset;
+
+	if (!image_offset(img, c, h, s, &offset))
+		return NULL;
+	return img->data + offset;
+}
+
+static int
+image_read(void *userdata, struct cpm_fs_sector_io *io, uint32_t count)
+{
+	struct cpm_image *img = (struct cpm_image *)userdata;
+	uint8_t *sector;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		sector = image_sector(
+			img, io[i].cylinder, io[i].head, io[i].sector);
+		if (!sector)
+			return -1;
+		memcpy(io[i].buf, sector, img->sector_size);
+	}
+	return 0;
+}
+
+static int
+image_write(void *userdata, const struct cpm_fs_sector_io *io, uint32_t count)
+{
+	struct cpm_image *img = (struct cpm_image *)userdata;
+	uint8_t *sector;
+
+	if (img->flags & CPM_FS_IMAGE_RDONLY)
+		return -1;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		sector = image_sector(
+			img, io[i].cylinder, io[i].head, io[i].sector);
+		if (!sector)
+			return -1;
+		memcpy(sector, io[i].buf, img->sector_size);
+	}
+	return 0;
+}
+
+/* Same as image_read and image_write, through io_uring */
+static int image_uring_rw(struct cpm_image *img,
+			  const struct cpm_fs_sector_io *io,
+			  uint32_t count,
+			  bool write)
+{
+	struct uring_req *reqs;
+	size_t offset;
+	int ret = 0;
+
+	if (write && (img->flags & CPM_FS_IMAGE_RDONLY))
+		return -1;
+
+	reqs = (struct uring_req *)malloc(count * sizeof(struct uring_req));
+	if (!reqs)
+		return -1;
+
+	for (uint32_t i = 0; i < count && !ret; ++i) {
+		if (!image_offset(img,
+				  io[i].cylinder,
+				  io[i].head,
+				  io[i].sector,
+				  &offset))
+			ret = -1;
+		reqs[i].buf = io[i].buf;
+		reqs[i].offset = offset;
+	}
+	if (!ret)
+		ret = uring_rw(
+			img->ring, img->fd, reqs, count, img->sector_size, write);
+
+	free(reqs);
+	return ret;
+}
+
+static int
+image_uring_read(void *userdata, struct cpm_fs_sector_io *io, uint32_t count)
+{
+	return image_uring_rw((struct cpm_image *)userdata, io, count, false);
+}
+
+static int image_uring_write(void *userdata,
+			     const struct cpm_fs_sector_io *io,
+			     uint32_t count)
+{
+	return image_uring_rw((struct cpm_image *)userdata, io, count, true);
+}
+
+static int image_read_one(void *userdata,
+			  uint32_t cylinder,
+			  uint32_t head,
+			  uint32_t sector,
+			  uint8_t *out_sector)
+{
+	struct cpm_image *img = (struct cpm_image *)userdata;
+	struct cpm_fs_sector_io io = { cylinder, head, sector, out_sector };
+
+	if (img->ring)
+		return image_uring_read(userdata, &io, 1);
+	return image_read(userdata, &io, 1);
+}
+
+static int image_write_one(void *userdata,
+			   uint32_t cylinder,
+			   uint32_t head,
+			   uint32_t sector,
+			   uint8_t *in_sector)
+{
+	struct cpm_image *img = (struct cpm_image *)userdata;
+	struct cpm_fs_sector_io io = { cylinder, head, sector, in_sector };
+
+	if (img->ring)
+		return image_uring_write(userdata, &io, 1);
+	return image_write(userdata, &io, 1);
+}
+
+static struct cpm_image *
+image_open(const char *path, struct cpm_fs_attr *attributes, uint32_t flags)
+{
+	bool rdonly = flags & CPM_FS_IMAGE_RDONLY;
+	struct cpm_image *img;
+	struct stat st;
+
+	img = (struct cpm_image *)calloc(sizeof(struct cpm_image), 1);
+	if (!img)
+		return NULL;
+
+	img->flags = flags;
+	img->cylinders = attributes->cylinders;
+	img->heads = attributes->heads;
+	img->sector_count = attributes->sector_count;
+	img->sector_size = attributes->sector_size;
+
+	img->fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+	if (img->fd < 0)
+		goto error;
+	if (fstat(img->fd, &st) != 0 || st.st_size <= 0)
+		goto error;
+
+	img->size = (size_t)st.st_size;
+
+	if (flags & CPM_FS_IMAGE_URING) {
+		img->ring = uring_open(attributes->queue_depth ?
+					       attributes->queue_depth :
+					       CPM_FS_DEFAULT_QUEUE_DEPTH);
+		/* Map the image when io_uring isn't available */
+		if (img->ring)
+			return img;
+	}
+
+	img->data = (uint8_t *)mmap(NULL,
+				    img->size,
+				    rdonly ? PROT_READ : PROT_READ | PROT_WRITE,
+				    MAP_SHARED,
+				    img->fd,
+				    0);
+	if (img->data == MAP_FAILED) {
+		img->data = NULL;
+		goto error;
+	}
+	return img;
+
+error:
+	image_close(img);
+	return NULL;
+}
+
+int image_sync(struct cpm_image *img)
+{
+	if (img->flags & CPM_FS_IMAGE_RDONLY)
+		return 0;
+	if (img->ring)
+		return fsync(img->fd) ? CPM_ERR_SECTOR_WRITE : 0;
+	return msync(img->data, img->size, MS_SYNC) ? CPM_ERR_SECTOR_WRITE : 0;
+}
+
+void image_close(struct cpm_image *img)
+{
+	if (!img)
+		return;
+	uring_close(img->ring);
+	if (img->data)
+		munmap(img->data, img->size);
+	if (img->fd >= 0)
+		close(img->fd);
+	free(img);
+}
+
+enum cpm_fs_status cpm_fs_new_from_image(const char *path,
+					 struct cpm_fs_attr *attributes,
+					 uint32_t flags,
+					 struct cpm_fs **out)
+{
+	struct cpm_fs_io io = {
+		image_read_one, image_write_one, image_read, image_write,
+		NULL,		NULL
+	};
+	struct cpm_image *img;
+	int ret;
+
+	if (!path || !attributes || !out)
+		return CPM_ERR_INVALID_ARG;
+
+	img = image_open(path, attributes, flags);
+	if (!img)
+		return CPM_ERR_IMAGE;
+
+	if (img->ring) {
+		io.read_sectors = image_uring_read;
+		io.write_sectors = image_uring_write;
+	}
+
+	ret = cpm_fs_new_io(attributes, &io, img, out);
+	if (ret) {
+		image_close(img);
+		return (enum cpm_fs_status)ret;
+	}
+
+	(*out)->image = img;
+	return CPM_SUCCESS;
+}
@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -19,7 +20,8 @@
 #define F_SET_ARCHIVED(entry) entry->extension[2] |= 0x80
 
 /* If the disk has less than 256 available blocks (including directory area),
- * block_ptr is interpreted as 16 integers. Otherwise it's 8 2-byte values. */
+ * block_ptr is interpreted as 16 integers. Otherwise it's 8 2-byte little
+ * endian values. */
 enum cpm_fs_block_addressing {
 	CPM_BLOCK_ADDR_8, /* 8 bit block pointers */
 	CPM_BLOCK_ADDR_16, /* 16 bit block pointers */
@@ -46,26 +48,110 @@ typedef struct {
 	uint8_t extent_h;
 	/* Record Count: number of 128-byte records in last logical extent. */
 	uint8_t rc;
-	union {
-		uint8_t block_ptr[16];
-		uint16_t block_ptr_w[8];
-	};
+	/* Use the cpm_block_ops of the filesystem to access block pointers */
+	uint8_t block_ptr[16];
 } __attribute__((packed, aligned(1))) cpm_entry;
 
 /* The extent number given by excent_l/_h corresponds to the highest logical
  * extent in the current entry. An entry can have multiple logical 16k extents.
  * In all cases, rc only refers to the last logical extent in that entry. */
 
+/* Block pointer accessors for one addressing mode, see cpmfs_blocks.c */
+struct cpm_block_ops {
+	uint8_t per_entry; /* Block pointers in an entry */
+	/* Decode every pointer of an entry, out must hold per_entry values */
+	void (*decode)(const cpm_entry *entry, uint16_t *out);
+	uint8_t (*used)(const cpm_entry *entry);
+	uint16_t (*last)(const cpm_entry *entry); /* 0 if none */
+	bool (*is_last)(const cpm_entry *entry, uint16_t idx);
+	void (*set)(cpm_entry *entry, uint8_t idx, uint16_t block);
+};
+
 struct cpm_superblock {
 	uint32_t count;
 	cpm_entry *entries;
+
+	/* Directory sectors modified since the last sync, one bit each */
+	uint64_t *dirty;
+	uint32_t sectors;
+};
+
+/* No entry / no file marker for the file table */
+#define CPM_NO_ENTRY UINT32_MAX
+
+/* Lookup key: user + filename + type, without status flags */
+#define CPM_KEY_LEN 12
+
+/* Directory entries of a file are chained by ascending extent number, and
+ * files are looked up through a hash of their key. This avoids scanning the
+ * whole directory for every name or extent lookup. */
+struct cpm_file {
+	uint32_t first; /* Entry with the lowest extent number */
+	uint32_t last; /* Entry with the highest extent number */
+	uint32_t hash_next; /* Next file in the same hash bucket */
+	uint32_t blocks; /* Used blocks in all entries */
+	uint32_t size; /* File size in bytes, as given by get_filesize */
+};
+
+struct cpm_file_table {
+	/* One slot per directory entry, as a file uses at least one */
+	struct cpm_file *files;
+	uint32_t *free_ids;
+	uint32_t free_count;
+
+	uint32_t *buckets;
+	uint32_t bucket_mask;
+
+	/* Unused directory entries, one bit per entry, set if free */
+	uint64_t *free_entries;
+
+	/* Indexed by directory entry */
+	uint32_t *entry_file; /* File slot, CPM_NO_ENTRY if unused */
+	uint32_t *entry_next; /* Entry holding the next extent */
+	uint32_t *entry_prev; /* Entry holding the previous extent */
+	uint8_t *entry_blocks; /* Used blocks, as last accounted */
+
+	/* Running totals for every user area */
+	struct cpm_fs_usage users[16];
 };
 
 struct cpm_fs_file_handle {
-	uint32_t entry;
-	uint32_t block; /* Current block index in the physical extent */
+	uint32_t entry; /* First entry of the file */
+	uint32_t block; /* Current block index in the file */
 	uint32_t offset; /* Offset in current block */
 	enum cpm_fs_mode mode;
+
+	/* File layout, resolved when opening and extended when writing */
+	uint16_t *blocks; /* Block numbers in file order */
+	uint32_t block_count;
+	uint32_t block_cap;
+	/* Entry holding every max_blocks_per_entry() blocks */
+	uint32_t *entries;
+	uint32_t entry_count;
+	uint32_t entry_cap;
+	/* Bytes used in the last block */
+	uint32_t last_block_size;
+	/* Vectored requests of this handle, iov_cap sectors. Separate from
+	 * fs->iov so handles can be read from different threads. */
+	struct cpm_fs_sector_io *iov;
+	/* Readahead: position where the previous read ended, and file
+	 * sector up to which sectors were already requested */
+	size_t ra_pos;
+	uint32_t ra_end;
+
+	/* Blocks from this index were allocated through this handle, their
+	 * previous contents don't matter */
+	uint32_t fresh_from;
+
+	/* Write buffer for one block, allocated on first write. Holds bytes
+	 * from wbuf_start to wbuf_end, the ones from wbuf_flushed aren't on
+	 * disk yet. */
+	uint8_t *wbuf;
+	uint32_t wbuf_block; /* Block index in the file, or CPM_NO_ENTRY */
+	uint32_t wbuf_start, wbuf_flushed, wbuf_end;
+
+	/* Open handles of the filesystem, flushed by cpm_fs_sync */
+	struct cpm_fs_file_handle *prev, *next;
 };
 
 struct cpm_fs_dir {
@@ -74,24 +160,100 @@ struct cpm_fs_dir {
 	int32_t current_file_ino;
 };
 
+/* LRU cache of disk sectors */
+struct cpm_cache_slot {
+	uint32_t key; /* Sector number from disk start, CPM_NO_ENTRY if empty */
+	uint32_t hash_next;
+	uint32_t prev, next; /* LRU list, most recently used first */
+	/* Being read without the cache lock, out of the LRU list until done */
+	bool loading;
+};
+
+struct cpm_sector_cache {
+	uint8_t *data; /* capacity sectors */
+	struct cpm_cache_slot *slots;
+	uint32_t capacity;
+	uint32_t *buckets;
+	uint32_t bucket_mask;
+	uint32_t head, tail;
+};
+
+/* Cache of whole tracks, for backends with track callbacks */
+struct cpm_track {
+	uint32_t key; /* cylinder * heads + head, CPM_NO_ENTRY if empty */
+	uint32_t last_use;
+	bool dirty;
+	uint8_t *data;
+};
+
+struct cpm_track_cache {
+	struct cpm_track *tracks;
+	uint32_t count;
+	uint32_t clock; /* Incremented on each use, for LRU eviction */
+	uint8_t *data;
+	/* Only taken by track_read, writers have the filesystem to
+	 * themselves */
+	pthread_mutex_t lock;
+	bool lock_init;
+};
+
 struct cpm_fs {
 	struct cpm_fs_attr attr;
 	struct cpm_superblock superblock;
+	struct cpm_file_table files;
 
-	/* Block allocation vector. One bit per block. */
-	uint8_t *av;
+	/* Block allocation vector. One bit per block, set if used. */
+	uint64_t *av;
+	uint32_t av_blocks; /* Number of blocks in the allocation vector */
+	uint32_t av_free; /* Number of unused blocks */
+	/* Only for CPM_ALLOC_CONTIGUOUS, bit is set if the next block isn't
+	 * on the same or next cylinder as the end of this one. */
+	uint64_t *av_breaks;
 
 	/* Total available size in bytes for files & superblock,
 	 * without skipped tracks */
 	uint32_t disk_size;
 	enum cpm_fs_block_addressing block_addressing;
-
-	/* Cache for one sector */
-	uint8_t *cache;
-
-	read_sector_cb read_sector;
-	write_sector_cb write_sector;
+	const struct cpm_block_ops *blk; /* Matching block_addressing */
+
+	/* Position of every sector of the file area, with skew and fill
+	 * order applied. Packed as (c << chs_cyl_shift) |
+	 * (h << chs_head_shift) | s. */
+	uint32_t *chs;
+	uint32_t chs_count;
+	uint8_t chs_head_shift, chs_cyl_shift;
+	/* log2 of the sector and block sizes, 0 if not a power of two */
+	uint8_t sector_shift, block_shift;
+
+	/* Held shared by operations only reading the disk through read-only
+	 * handles, exclusively by everything else */
+	pthread_rwlock_t lock;
+	bool lock_init;
+	/* Sector cache updates by concurrent readers */
+	pthread_mutex_t cache_lock;
+	/* Signaled when loading slots are done */
+	pthread_cond_t cache_cond;
+	bool cache_lock_init;
+	/* List of open handles, also modified by readers */
+	pthread_mutex_t handles_lock;
+	bool handles_lock_init;
+
+	struct cpm_sector_cache cache;
+	struct cpm_track_cache tracks;
+	struct cpm_fs_file_handle *handles;
+	/* One sector, to build sectors before writing them */
+	uint8_t *scratch;
+
+	struct cpm_fs_io io;
 	void *userdata;
+	/* Readahead window in sectors, capped to the cache capacity */
+	uint32_t readahead;
+	/* Scratch for vectored requests, holds a block, the directory or the
+	 * readahead window */
+	struct cpm_fs_sector_io *iov;
+	uint32_t iov_cap;
+	/* Set when mounted with cpm_fs_new_from_image */
+	struct cpm_image *image;
 };
 
 struct cpm_fs_crawler {
@@ -105,6 +267,10 @@ struct cpm_fs_crawler {
 /* Get disk size available for files, in bytes.
  * Reserved tracks excluded, superblock included */
 uint32_t get_disk_size(struct cpm_fs *fs);
+
+/* Build the sector position table used by block_to_chs. Must be called
+ * once the skew table is set. */
+int chs_init(struct cpm_fs *fs);
 void block_to_chs(struct cpm_fs *fs,
 		  uint32_t block,
 		  uint32_t block_offset,
@@ -112,19 +278,165 @@ void block_to_chs(struct cpm_fs *fs,
 		  uint32_t *h,
 		  uint32_t *s);
 
+/* --- Sector I/O and cache ------------------------------------------- */
+
+/* Read or write a batch of sectors, with the vectored callbacks if any.
+ * Written sectors are updated in the cache. */
+int disk_read(struct cpm_fs *fs, struct cpm_fs_sector_io *io, uint32_t count);
+int disk_write(struct cpm_fs *fs,
+	       const struct cpm_fs_sector_io *io,
+	       uint32_t count);
+
+int cache_init(struct cpm_fs *fs);
+void cache_free(struct cpm_fs *fs);
+
+/* Get a sector, reading it on a cache miss. The pointer is valid until the
+ * next cache call. Doesn't lock the cache, only for exclusive operations. */
+int cache_read(struct cpm_fs *fs,
+	       uint32_t c,
+	       uint32_t h,
+	       uint32_t s,
+	       uint8_t **out_sector);
+
+/* The functions below lock the cache, they can be used by concurrent
+ * readers. The lock isn't held during disk reads, sectors being loaded are
+ * waited for. */
+
+/* Copy a whole sector into buf if it's cached, return false otherwise */
+bool cache_copy(struct cpm_fs *fs,
+		uint32_t c,
+		uint32_t h,
+		uint32_t s,
+		uint8_t *buf);
+
+/* Copy count bytes at offset of a sector, reading it on a cache miss */
+int cache_read_part(struct cpm_fs *fs,
+		    uint32_t c,
+		    uint32_t h,
+		    uint32_t s,
+		    uint8_t *buf,
+		    uint32_t offset,
+		    uint32_t count);
+
+/* Load the sectors of io missing from the cache with a single disk_read,
+ * up to the cache capacity. io is modified. */
+int cache_prefetch(struct cpm_fs *fs,
+		   struct cpm_fs_sector_io *io,
+		   uint32_t count);
+
+/* Write count bytes at offset in a sector, through the cache. When keep is
+ * set, the rest of the sector is read first if needed. Otherwise it's
+ * undefined, use it for sectors past the end of a file. */
+int cache_write(struct cpm_fs *fs,
+		uint32_t c,
+		uint32_t h,
+		uint32_t s,
+		const uint8_t *buf,
+		uint32_t offset,
+		uint32_t count,
+		bool keep);
+
+/* --- Locking -------------------------------------------------------- */
+
+/* Shared lock for operations which only read the disk, exclusive for the
+ * others. fs_lock_handle takes the shared lock for read-only handles. */
+void fs_lock_shared(struct cpm_fs *fs);
+void fs_lock(struct cpm_fs *fs);
+void fs_lock_handle(struct cpm_fs *fs, struct cpm_fs_file_handle *fh);
+void fs_unlock(struct cpm_fs *fs);
+
+/* --- Track cache ---------------------------------------------------- */
+
+/* Only allocated when the read_track callback is set */
+int track_init(struct cpm_fs *fs);
+void track_free(struct cpm_fs *fs);
+
+/* Sector I/O through cached tracks, used by disk_read and disk_write */
+int track_read(struct cpm_fs *fs, struct cpm_fs_sector_io *io, uint32_t count);
+int track_write(struct cpm_fs *fs,
+		const struct cpm_fs_sector_io *io,
+		uint32_t count);
+
+/* Update cached tracks after writing sectors without write_track */
+void track_update(struct cpm_fs *fs,
+		  const struct cpm_fs_sector_io *io,
+		  uint32_t count);
+
+/* Write back modified tracks */
+int track_flush(struct cpm_fs *fs);
+
+/* --- Image backend --------------------------------------------------- */
+
+/* Flush a writable mapping to the image file */
+int image_sync(struct cpm_image *img);
+/* Unmap and close the image, accepts NULL */
+void image_close(struct cpm_image *img);
+
+/* --- io_uring -------------------------------------------------------- */
+
+struct cpm_uring;
+
+/* One sector of a uring_rw request */
+struct uring_req {
+	uint8_t *buf;
+	uint64_t offset; /* In the file */
+};
+
+/* Create a ring keeping up to depth requests in flight. Returns NULL when
+ * io_uring isn't available. */
+struct cpm_uring *uring_open(uint32_t depth);
+/* Accepts NULL */
+void uring_close(struct cpm_uring *ring);
+
+/* Read or write len bytes for every request, returns 0 or -1 if any of them
+ * failed. Can be called from several threads at once. */
+int uring_rw(struct cpm_uring *ring,
+	     int fd,
+	     const struct uring_req *reqs,
+	     uint32_t count,
+	     uint32_t len,
+	     bool write);
+
+/* --- Bitmaps --------------------------------------------------------- */
+
+/* Number of 64-bit words needed for a bitmap */
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+
+void bitmap_set(uint64_t *map, uint32_t bit);
+void bitmap_clear(uint64_t *map, uint32_t bit);
+bool bitmap_get(const uint64_t *map, uint32_t bit);
+
+/* Return the first set/clear bit from start, or CPM_NO_ENTRY if none */
+uint32_t bitmap_find_set(const uint64_t *map, uint32_t bits, uint32_t start);
+uint32_t bitmap_find_clear(const uint64_t *map, uint32_t bits, uint32_t start);
+/* Number of set bits */
+uint32_t bitmap_count(const uint64_t *map, uint32_t bits);
+
 /* --- Allocation vector ----------------------------------------------- */
 
-/* 0 on success, negative status on error */
-int av_build(struct cpm_fs *fs);
+/* Allocate the allocation vector with only the directory blocks marked.
+ * File blocks are marked by check_superblock. */
+int av_init(struct cpm_fs *fs);
 
+/* av_set and av_unset keep the free block count up to date */
 void av_set(struct cpm_fs *fs, int block_index);
 void av_unset(struct cpm_fs *fs, int block_index);
 int av_get(struct cpm_fs *fs, int block_index);
 
+/* Return the first unused block from start, or CPM_NO_ENTRY if none */
+uint32_t av_find_free(struct cpm_fs *fs, uint32_t start);
+
 /* --- Validity checks ------------------------------------------------- */
 
-/* Check for superblock validity, returns 0 or negative error code */
-int check_superblock(struct cpm_fs *fs);
+/* Check for superblock validity and mark the blocks used by files in the
+ * allocation vector, in a single pass. Returns 0 or the error cpm_fs_new
+ * should fail with. Every conflict is listed in report when not NULL. */
+int check_superblock(struct cpm_fs *fs, struct cpm_fs_check_report *report);
+
+/* Check the superblock and build the allocation vector unless already done,
+ * which only happens with CPM_FS_MOUNT_LAZY. Every operation modifying the
+ * disk or using the allocation vector must call this first. */
+int ensure_checked(struct cpm_fs *fs);
 
 /* Return true if the given character is accepted for filenames */
 bool is_allowed_char(char c);
@@ -151,6 +463,26 @@ int rename_file(const char *old_path,
 		const char *new_path,
 		int new_user);
 
+/* Printable "FILE.EXT" name of an entry, out must hold 13 bytes */
+void entry_get_name(const cpm_entry *entry, char *out);
+
+/* Directory listing information of the file starting at entry ino */
+void get_file_info(struct cpm_fs *fs, uint32_t ino, struct cpm_fs_file *out);
+
+/* Resolve every block of the file starting at fh->entry, up to the first
+ * unused block pointer. Fills blocks, entries and last_block_size. */
+int build_block_map(struct cpm_fs *fs, struct cpm_fs_file_handle *fh);
+
+/* Read from a block into buf, from start up to end. Whole sectors are read
+ * straight into buf with iov (iov_cap sectors), only partial ones go
+ * through the cache. */
+int read_block(struct cpm_fs *fs,
+	       struct cpm_fs_sector_io *iov,
+	       uint16_t block,
+	       uint8_t *buf,
+	       uint32_t start,
+	       uint32_t end);
+
 /* Check path validity and extract parts (spaces included).
  * Return 0 on success or negative error code. */
 int parse_filename(const char *pathname,
@@ -159,11 +491,66 @@ int parse_filename(const char *pathname,
 		   char **out_ext,
 		   size_t *out_extlen);
 
+/* --- Extraction ----------------------------------------------------- */
+
+/* Layout of a file, planned from the directory */
+struct plan_file {
+	struct cpm_fs_file info;
+	uint16_t *blocks; /* Block numbers in file order */
+	uint32_t block_count;
+	uint32_t last_block_size; /* Bytes used in the last block */
+	size_t size; /* Bytes read through a handle */
+};
+
+/* Resolve the blocks of every file in directory order, with a single pass
+ * over the directory. Needs at least the shared lock. */
+int plan_files(struct cpm_fs *fs,
+	       struct plan_file **out_files,
+	       uint32_t *out_count);
+/* Accepts NULL */
+void free_plan(struct plan_file *files, uint32_t count);
+
+/* --- File table ----------------------------------------------------- */
+
+/* Build the file table from the superblock, returns 0 or error code */
+int ft_build(struct cpm_fs *fs);
+void ft_free(struct cpm_fs *fs);
+
+/* Get lookup key (CPM_KEY_LEN bytes) for given entry */
+void ft_entry_key(const cpm_entry *entry, uint8_t *out_key);
+
+/* Return file slot matching key, or CPM_NO_ENTRY */
+uint32_t ft_lookup(struct cpm_fs *fs, const uint8_t *key);
+
+/* Must be called after an entry is allocated, or before it's wiped.
+ * This also keeps track of free directory entries. */
+void ft_add_entry(struct cpm_fs *fs, uint32_t entry_idx);
+void ft_remove_entry(struct cpm_fs *fs, uint32_t entry_idx);
+
+/* Change user, filename and type of every entry of a file.
+ * name and ext are space padded, status flags are kept. */
+void ft_rename(struct cpm_fs *fs,
+	       uint32_t file,
+	       uint8_t user,
+	       const char *name,
+	       const char *ext);
+
+/* Must be called when the size of an entry changes (rc, blocks), to keep
+ * file size and usage totals up to date */
+void ft_touch(struct cpm_fs *fs, uint32_t entry_idx);
+
 /* --- Extents---------------------------------------------------------- */
 
 /* Physical extents / directory entries */
+
+/* Must be called whenever an entry is modified, so it's written on sync */
+void mark_entry_dirty(struct cpm_fs *fs, uint32_t entry_idx);
+
 int alloc_new_extent(struct cpm_fs *fs, cpm_entry *src_entry);
+/* Return entry holding the next extent, CPM_NO_ENTRY if none */
 uint32_t get_next_extent(struct cpm_fs *fs, uint32_t extent);
+/* Return entry holding the first extent of the same file */
+uint32_t get_first_extent(struct cpm_fs *fs, uint32_t extent);
 void wipe_extent(struct cpm_fs *fs, int entry_idx);
 
 bool entry_is_first_extent(struct cpm_fs *fs, uint32_t extent);
@@ -175,6 +562,16 @@ void set_extent_nb(cpm_entry *entry, uint32_t number);
 
 /* ---- Blocks --------------------------------------------------------- */
 
+/* Set block_addressing and the matching block pointer accessors */
+void set_block_addressing(struct cpm_fs *fs,
+			  enum cpm_fs_block_addressing addressing);
+
+/* Block pointers of an entry as native values, out must hold 16 values.
+ * Returns the number of pointers in an entry. */
+uint8_t entry_get_blocks(struct cpm_fs *fs,
+			 const cpm_entry *entry,
+			 uint16_t *out);
+
 /* True if the block index is the last used block of given entry */
 bool is_last_block(struct cpm_fs *fs, cpm_entry *entry, uint16_t idx);
 
@@ -189,4 +586,10 @@ void entry_set_block(struct cpm_fs *fs,
 		     uint8_t idx,
 		     uint16_t block);
 
-uint16_t find_free_block(struct cpm_fs *fs);
+/* Return a free block according to the allocation policy, or 0 if the disk
+ * is full. prev is the last block of the file, 0 for an empty file. */
+uint16_t find_free_block(struct cpm_fs *fs, uint16_t prev);
+
+/* Return the start of the first run of at least len free blocks from
+ * start, or CPM_NO_ENTRY if none */
+uint32_t find_free_run(struct cpm_fs *fs, uint32_t start, uint32_t len);
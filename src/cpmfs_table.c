@@ -0,0 +1,340 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <string.h>
+
+#include "cpmfs_internal.h"
+
+/* FNV-1a on user + filename + type */
+static uint32_t hash_key(const uint8_t *key)
+{
+	uint32_t hash = 2166136261u;
+
+	for (int i = 0; i < CPM_KEY_LEN; ++i) {
+		hash ^= key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void ft_entry_key(const cpm_entry *entry, uint8_t *out_key)
+{
+	out_key[0] = entry->status;
+	for (int i = 0; i < 8; ++i)
+		out_key[1 + i] = entry->file[i] & 0x7F;
+	for (int i = 0; i < 3; ++i)
+		out_key[9 + i] = entry->extension[i] & 0x7F;
+}
+
+static uint32_t *bucket_of(struct cpm_file_table *ft, const uint8_t *key)
+{
+	return &ft->buckets[hash_key(key) & ft->bucket_mask];
+}
+
+static void bucket_insert(struct cpm_fs *fs, uint32_t file)
+{
+	struct cpm_file_table *ft = &fs->files;
+	uint8_t key[CPM_KEY_LEN];
+	uint32_t *bucket;
+
+	ft_entry_key(&fs->superblock.entries[ft->files[file].first], key);
+	bucket = bucket_of(ft, key);
+	ft->files[file].hash_next = *bucket;
+	*bucket = file;
+}
+
+static void bucket_remove(struct cpm_fs *fs, uint32_t file)
+{
+	struct cpm_file_table *ft = &fs->files;
+	uint8_t key[CPM_KEY_LEN];
+	uint32_t *it;
+
+	ft_entry_key(&fs->superblock.entries[ft->files[file].first], key);
+	for (it = bucket_of(ft, key); *it != CPM_NO_ENTRY;
+	     it = &ft->files[*it].hash_next) {
+		if (*it == file) {
+			*it = ft->files[file].hash_next;
+			return;
+		}
+	}
+}
+
+/* Usage totals for the user owning given file, NULL for non-user entries */
+static struct cpm_fs_usage *file_usage(struct cpm_fs *fs, uint32_t file)
+{
+	uint8_t user = fs->superblock.entries[fs->files.files[file].first].status;
+
+	return is_valid_user(user) ? &fs->files.users[user] : NULL;
+}
+
+/* Same result as the former get_filesize directory walk: full blocks for
+ * every entry but the last one, whose size is given by RC. */
+static uint32_t compute_size(struct cpm_fs *fs, struct cpm_file *file)
+{
+	cpm_entry *last = &fs->superblock.entries[file->last];
+	uint8_t last_blocks = fs->files.entry_blocks[file->last];
+	/* How many blocks per logical extent (16k) */
+	uint8_t block_per_extent = 0x4000 / fs->attr.block_size;
+	uint32_t size;
+
+	size = (file->blocks - last_blocks) * fs->attr.block_size;
+	/* Size of full logical extents in last entry */
+	if (last_blocks > 0)
+		size += 0x4000 * ((last_blocks - 1) / block_per_extent);
+	return size + 128 * last->rc;
+}
+
+/* Refresh block count and size of a file after given entry changed */
+static void update_usage(struct cpm_fs *fs, uint32_t entry_idx)
+{
+	struct cpm_file_table *ft = &fs->files;
+	uint32_t id = ft->entry_file[entry_idx];
+	struct cpm_file *file = &ft->files[id];
+	struct cpm_fs_usage *usage = file_usage(fs, id);
+	uint8_t blocks;
+	uint32_t size;
+
+	blocks = get_used_blocks(fs, &fs->superblock.entries[entry_idx]);
+	file->blocks += blocks;
+	file->blocks -= ft->entry_blocks[entry_idx];
+	if (usage) {
+		usage->blocks += blocks;
+		usage->blocks -= ft->entry_blocks[entry_idx];
+	}
+	ft->entry_blocks[entry_idx] = blocks;
+
+	size = compute_size(fs, file);
+	if (usage) {
+		usage->bytes += size;
+		usage->bytes -= file->size;
+	}
+	file->size = size;
+}
+
+uint32_t ft_lookup(struct cpm_fs *fs, const uint8_t *key)
+{
+	struct cpm_file_table *ft = &fs->files;
+	uint8_t file_key[CPM_KEY_LEN];
+	uint32_t it;
+
+	for (it = *bucket_of(ft, key); it != CPM_NO_ENTRY;
+	     it = ft->files[it].hash_next) {
+		ft_entry_key(&fs->superblock.entries[ft->files[it].first],
+			     file_key);
+		if (memcmp(file_key, key, CPM_KEY_LEN) == 0)
+			return it;
+	}
+	return CPM_NO_ENTRY;
+}
+
+void ft_add_entry(struct cpm_fs *fs, uint32_t entry_idx)
+{
+	struct cpm_file_table *ft = &fs->files;
+	cpm_entry *entry = &fs->superblock.entries[entry_idx];
+	uint8_t key[CPM_KEY_LEN];
+	struct cpm_file *file;
+	uint32_t id, prev;
+
+	bitmap_clear(ft->free_entries, entry_idx);
+
+	ft_entry_key(entry, key);
+	id = ft_lookup(fs, key);
+	if (id == CPM_NO_ENTRY) {
+		/* New file, there's always a free slot as there are as many
+		 * slots as directory entries */
+		id = ft->free_ids[--ft->free_count];
+		file = &ft->files[id];
+		file->first = entry_idx;
+		file->last = entry_idx;
+		file->blocks = 0;
+		file->size = 0;
+		ft->entry_prev[entry_idx] = CPM_NO_ENTRY;
+		ft->entry_next[entry_idx] = CPM_NO_ENTRY;
+		ft->entry_file[entry_idx] = id;
+		ft->entry_blocks[entry_idx] = 0;
+		bucket_insert(fs, id);
+		if (file_usage(fs, id))
+			file_usage(fs, id)->files++;
+		update_usage(fs, entry_idx);
+		return;
+	}
+
+	/* Keep the chain sorted by extent number. New extents are appended
+	 * when writing and directories are usually sorted, so this walk
+	 * stops right away in most cases. */
+	file = &ft->files[id];
+	prev = file->last;
+	while (prev != CPM_NO_ENTRY &&
+	       extent_nb(&fs->superblock.entries[prev]) > extent_nb(entry))
+		prev = ft->entry_prev[prev];
+
+	if (prev == CPM_NO_ENTRY) {
+		/* New first extent, the hash key is unchanged */
+		ft->entry_next[entry_idx] = file->first;
+		ft->entry_prev[file->first] = entry_idx;
+		file->first = entry_idx;
+	} else {
+		ft->entry_next[entry_idx] = ft->entry_next[prev];
+		if (ft->entry_next[prev] != CPM_NO_ENTRY)
+			ft->entry_prev[ft->entry_next[prev]] = entry_idx;
+		else
+			file->last = entry_idx;
+		ft->entry_next[prev] = entry_idx;
+	}
+	ft->entry_prev[entry_idx] = prev;
+	ft->entry_file[entry_idx] = id;
+	ft->entry_blocks[entry_idx] = 0;
+	update_usage(fs, entry_idx);
+}
+
+void ft_remove_entry(struct cpm_fs *fs, uint32_t entry_idx)
+{
+	struct cpm_file_table *ft = &fs->files;
+	uint32_t id = ft->entry_file[entry_idx];
+	uint32_t prev = ft->entry_prev[entry_idx];
+	uint32_t next = ft->entry_next[entry_idx];
+	struct cpm_fs_usage *usage;
+	struct cpm_file *file;
+
+	if (id == CPM_NO_ENTRY)
+		return;
+
+	bitmap_set(ft->free_entries, entry_idx);
+	file = &ft->files[id];
+	usage = file_usage(fs, id);
+	if (file->first == entry_idx && file->last == entry_idx) {
+		/* Last entry of the file */
+		if (usage) {
+			usage->files--;
+			usage->blocks -= file->blocks;
+			usage->bytes -= file->size;
+		}
+		bucket_remove(fs, id);
+		ft->free_ids[ft->free_count++] = id;
+	} else {
+		if (prev != CPM_NO_ENTRY)
+			ft->entry_next[prev] = next;
+		else
+			file->first = next;
+		if (next != CPM_NO_ENTRY)
+			ft->entry_prev[next] = prev;
+		else
+			file->last = prev;
+
+		/* Account for the removed entry, then resize */
+		file->blocks -= ft->entry_blocks[entry_idx];
+		if (usage)
+			usage->blocks -= ft->entry_blocks[entry_idx];
+		ft->entry_blocks[entry_idx] = 0;
+		ft->entry_file[entry_idx] = CPM_NO_ENTRY;
+		update_usage(fs, file->last);
+	}
+	ft->entry_file[entry_idx] = CPM_NO_ENTRY;
+	ft->entry_next[entry_idx] = CPM_NO_ENTRY;
+	ft->entry_prev[entry_idx] = CPM_NO_ENTRY;
+}
+
+void ft_rename(struct cpm_fs *fs,
+	       uint32_t file,
+	       uint8_t user,
+	       const char *name,
+	       const char *ext)
+{
+	struct cpm_file_table *ft = &fs->files;
+	struct cpm_fs_usage *usage;
+	cpm_entry *entry;
+
+	/* Move usage to the new user */
+	usage = file_usage(fs, file);
+	if (usage) {
+		usage->files--;
+		usage->blocks -= ft->files[file].blocks;
+		usage->bytes -= ft->files[file].size;
+	}
+
+	bucket_remove(fs, file);
+	for (uint32_t i = ft->files[file].first; i != CPM_NO_ENTRY;
+	     i = ft->entry_next[i]) {
+		entry = &fs->superblock.entries[i];
+		entry->status = user;
+		memcpy(entry->file, name, 8);
+		/* Keep status flags stored in the high bits */
+		for (int j = 0; j < 3; ++j)
+			entry->extension[j] =
+				(entry->extension[j] & 0x80) | (ext[j] & 0x7F);
+		mark_entry_dirty(fs, i);
+	}
+	bucket_insert(fs, file);
+
+	usage = file_usage(fs, file);
+	if (usage) {
+		usage->files++;
+		usage->blocks += ft->files[file].blocks;
+		usage->bytes += ft->files[file].size;
+	}
+}
+
+void ft_touch(struct cpm_fs *fs, uint32_t entry_idx)
+{
+	if (fs->files.entry_file[entry_idx] != CPM_NO_ENTRY)
+		update_usage(fs, entry_idx);
+}
+
+int ft_build(struct cpm_fs *fs)
+{
+	struct cpm_file_table *ft = &fs->files;
+	uint32_t count = fs->superblock.count;
+	uint32_t buckets = 1;
+
+	while (buckets < count)
+		buckets <<= 1;
+
+	ft->files = (struct cpm_file *)calloc(count, sizeof(struct cpm_file));
+	ft->free_ids = (uint32_t *)malloc(count * sizeof(uint32_t));
+	ft->buckets = (uint32_t *)malloc(buckets * sizeof(uint32_t));
+	ft->entry_file = (uint32_t *)malloc(count * sizeof(uint32_t));
+	ft->entry_next = (uint32_t *)malloc(count * sizeof(uint32_t));
+	ft->entry_prev = (uint32_t *)malloc(count * sizeof(uint32_t));
+	ft->entry_blocks = (uint8_t *)calloc(count, 1);
+	ft->free_entries =
+		(uint64_t *)calloc(BITMAP_WORDS(count), sizeof(uint64_t));
+	if (!ft->files || !ft->free_ids || !ft->buckets || !ft->entry_file ||
+	    !ft->entry_next || !ft->entry_prev || !ft->entry_blocks ||
+	    !ft->free_entries)
+		return CPM_ERR_NOMEM;
+
+	ft->bucket_mask = buckets - 1;
+	memset(ft->buckets, 0xFF, buckets * sizeof(uint32_t));
+	memset(ft->entry_file, 0xFF, count * sizeof(uint32_t));
+	memset(ft->entry_next, 0xFF, count * sizeof(uint32_t));
+	memset(ft->entry_prev, 0xFF, count * sizeof(uint32_t));
+
+	/* Pop lowest ids first */
+	ft->free_count = count;
+	for (uint32_t i = 0; i < count; ++i)
+		ft->free_ids[i] = count - 1 - i;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		if (fs->superblock.entries[i].status != 0xE5)
+			ft_add_entry(fs, i);
+		else
+			bitmap_set(ft->free_entries, i);
+	}
+
+	return CPM_SUCCESS;
+}
+
+void ft_free(struct cpm_fs *fs)
+{
+	struct cpm_file_table *ft = &fs->files;
+
+	free(ft->files);
+	free(ft->free_ids);
+	free(ft->buckets);
+	free(ft->entry_file);
+	free(ft->entry_next);
+	free(ft->entry_prev);
+	free(ft->entry_blocks);
+	free(ft->free_entries);
+	memset(ft, 0, sizeof(*ft));
+}
@@ -0,0 +1,404 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpmfs_internal.h"
+
+/* Files are written to the archive as soon as their last block is read,
+ * sweeping every allocated block in physical order. Blocks of the next file
+ * of the archive are streamed straight to the sink, other ones are kept in
+ * memory until their file is written. */
+
+#define TAR_RECORD 512
+
+/* One allocated block, in sweep order */
+struct tar_block {
+	uint64_t key; /* Physical position of the first sector */
+	uint32_t file;
+	uint32_t index; /* In the file */
+};
+
+struct tar_file {
+	struct plan_file *plan;
+	/* Sweep position after its last block, 0 for empty files */
+	uint32_t done_at;
+	uint32_t written; /* Blocks already written to the archive */
+	bool started; /* Header written */
+	/* Blocks read ahead of time, NULL if not read or not kept */
+	uint8_t **bufs;
+};
+
+struct tar_export {
+	struct cpm_fs *fs;
+	cpm_fs_stream_cb sink;
+	void *userdata;
+
+	struct tar_file *files;
+	uint32_t *order; /* Files in archive order */
+	uint32_t emitted; /* Files of order already written */
+	size_t buffered, max_buffer;
+
+	struct cpm_fs_sector_io *iov;
+	uint8_t *block; /* Blocks being written */
+	uint8_t record[TAR_RECORD];
+};
+
+static int block_cmp(const void *a, const void *b)
+{
+	const struct tar_block *x = (const struct tar_block *)a;
+	const struct tar_block *y = (const struct tar_block *)b;
+
+	if (x->key != y->key)
+		return (x->key > y->key) ? 1 : -1;
+	return 0;
+}
+
+/* Archive order of a file */
+struct tar_order {
+	uint32_t done_at;
+	uint32_t file;
+};
+
+/* By end of the file in the sweep, then directory order */
+static int order_cmp(const void *a, const void *b)
+{
+	const struct tar_order *x = (const struct tar_order *)a;
+	const struct tar_order *y = (const struct tar_order *)b;
+
+	if (x->done_at != y->done_at)
+		return (x->done_at > y->done_at) ? 1 : -1;
+	if (x->file != y->file)
+		return (x->file > y->file) ? 1 : -1;
+	return 0;
+}
+
+/* Octal number field, NUL terminated */
+static void tar_octal(char *field, size_t len, uint64_t value)
+{
+	snprintf(field, len, "%0*llo", (int)len - 1, (unsigned long long)value);
+}
+
+/* Fill a ustar header in ex->record */
+static void tar_header(struct tar_export *ex,
+		       const char *name,
+		       char type,
+		       size_t size,
+		       int mode)
+{
+	uint8_t *h = ex->record;
+	uint32_t sum = 0;
+
+	memset(h, 0, TAR_RECORD);
+	snprintf((char *)h, 100, "%s", name);
+	tar_octal((char *)h + 100, 8, (uint64_t)mode);
+	tar_octal((char *)h + 108, 8, 0); /* uid */
+	tar_octal((char *)h + 116, 8, 0); /* gid */
+	tar_octal((char *)h + 124, 12, size);
+	tar_octal((char *)h + 136, 12, 0); /* mtime, CP/M 2.2 has none */
+	h[156] = (uint8_t)type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	/* Checksum is computed with its own field filled with spaces */
+	memset(h + 148, ' ', 8);
+	for (uint32_t i = 0; i < TAR_RECORD; ++i)
+		sum += h[i];
+	snprintf((char *)h + 148, 8, "%06o", sum);
+}
+
+/* Zeros up to the next record */
+static int tar_pad(struct tar_export *ex, size_t size)
+{
+	if (size % TAR_RECORD == 0)
+		return 0;
+	memset(ex->record, 0, TAR_RECORD);
+	return ex->sink(
+		ex->userdata, ex->record, TAR_RECORD - size % TAR_RECORD);
+}
+
+/* Write the headers of a file. The user area is the directory, attributes
+ * are kept in a PAX header as LIBCPMFS.flags with R, S and A letters. */
+static int tar_start(struct tar_export *ex, struct tar_file *file)
+{
+	struct cpm_fs_file *info = &file->plan->info;
+	/* CP/M names are 8.3, at most 12 characters */
+	char name[32], flags[4], pax[64];
+	size_t flag_count = 0;
+	int len, ret;
+
+	if (info->d_flags & CPM_FS_FLAG_READONLY)
+		flags[flag_count++] = 'R';
+	if (info->d_flags & CPM_FS_FLAG_SYSTEM)
+		flags[flag_count++] = 'S';
+	if (info->d_flags & CPM_FS_FLAG_ARCHIVED)
+		flags[flag_count++] = 'A';
+	flags[flag_count] = '\0';
+
+	if (flag_count) {
+		/* Record length counts its own digits */
+		len = (int)strlen(" LIBCPMFS.flags=\n") + (int)flag_count + 2;
+		snprintf(pax,
+			 sizeof(pax),
+			 "%d LIBCPMFS.flags=%s\n",
+			 len,
+			 flags);
+		snprintf(name,
+			 sizeof(name),
+			 "%u/PaxHeaders/%.12s",
+			 info->d_user,
+			 info->d_name);
+		tar_header(ex, name, 'x', (size_t)len, 0644);
+		if ((ret = ex->sink(ex->userdata, ex->record, TAR_RECORD)))
+			return ret;
+		ret = ex->sink(ex->userdata, (uint8_t *)pax, (size_t)len);
+		if (ret)
+			return ret;
+		if ((ret = tar_pad(ex, (size_t)len)))
+			return ret;
+	}
+
+	snprintf(name, sizeof(name), "%u/%.12s", info->d_user, info->d_name);
+	tar_header(ex,
+		   name,
+		   '0',
+		   file->plan->size,
+		   (info->d_flags & CPM_FS_FLAG_READONLY) ? 0444 : 0644);
+	file->started = true;
+	return ex->sink(ex->userdata, ex->record, TAR_RECORD);
+}
+
+/* Bytes of block i written to the archive */
+static uint32_t
+block_len(struct cpm_fs *fs, struct plan_file *plan, uint32_t i)
+{
+	return i == plan->block_count - 1 ? plan->last_block_size :
+					    fs->attr.block_size;
+}
+
+/* Write the blocks of a file available in order, from the sweep or kept in
+ * memory. Missing blocks are read now when the file is complete. */
+static int tar_write_blocks(struct tar_export *ex,
+			    struct tar_file *file,
+			    bool complete)
+{
+	struct plan_file *plan = file->plan;
+	uint32_t len;
+	int ret;
+
+	if (!file->started && (ret = tar_start(ex, file)))
+		return ret;
+
+	for (; file->written < plan->block_count; file->written++) {
+		len = block_len(ex->fs, plan, file->written);
+		if (file->bufs && file->bufs[file->written]) {
+			ret = ex->sink(ex->userdata,
+				       file->bufs[file->written],
+				       len);
+			free(file->bufs[file->written]);
+			file->bufs[file->written] = NULL;
+			ex->buffered -= ex->fs->attr.block_size;
+		} else if (complete) {
+			/* Wasn't kept, more than max_buffer was needed */
+			ret = read_block(ex->fs,
+					 ex->iov,
+					 plan->blocks[file->written],
+					 ex->block,
+					 0,
+					 len);
+			if (!ret)
+				ret = ex->sink(ex->userdata, ex->block, len);
+		} else {
+			return 0;
+		}
+		if (ret)
+			return ret;
+	}
+
+	return complete ? tar_pad(ex, plan->size) : 0;
+}
+
+/* Write every file completed once pos blocks of the sweep were read */
+static int tar_emit(struct tar_export *ex, uint32_t pos, uint32_t count)
+{
+	struct tar_file *file;
+	int ret;
+
+	while (ex->emitted < count) {
+		file = &ex->files[ex->order[ex->emitted]];
+		if (file->done_at > pos)
+			return 0;
+		if ((ret = tar_write_blocks(ex, file, true)))
+			return ret;
+		free(file->bufs);
+		file->bufs = NULL;
+		ex->emitted++;
+	}
+	return 0;
+}
+
+/* Handle one block read by the sweep, in ex->block */
+static int tar_take(struct tar_export *ex, const struct tar_block *b)
+{
+	struct tar_file *file = &ex->files[b->file];
+	uint32_t bs = ex->fs->attr.block_size;
+	int ret;
+
+	/* Next block of the file being written, no need to keep it */
+	if (ex->order[ex->emitted] == b->file && file->written == b->index) {
+		if (!file->started && (ret = tar_start(ex, file)))
+			return ret;
+		ret = ex->sink(ex->userdata,
+			       ex->block,
+			       block_len(ex->fs, file->plan, b->index));
+		if (ret)
+			return ret;
+		file->written++;
+		return tar_write_blocks(ex, file, false);
+	}
+
+	/* Read again later when it doesn't fit */
+	if (ex->buffered + bs > ex->max_buffer)
+		return 0;
+	if (!file->bufs) {
+		file->bufs = (uint8_t **)calloc(file->plan->block_count,
+						sizeof(uint8_t *));
+		if (!file->bufs)
+			return CPM_ERR_NOMEM;
+	}
+	file->bufs[b->index] = (uint8_t *)malloc(bs);
+	if (!file->bufs[b->index])
+		return CPM_ERR_NOMEM;
+	memcpy(file->bufs[b->index], ex->block, bs);
+	ex->buffered += bs;
+	return 0;
+}
+
+static int export_tar(struct tar_export *ex,
+		      struct plan_file *plans,
+		      uint32_t count)
+{
+	struct tar_block *sweep = NULL;
+	struct tar_order *order;
+	uint32_t total = 0, n = 0;
+	uint32_t c, h, s;
+	int ret;
+
+	ex->files = (struct tar_file *)calloc(count ? count : 1,
+					      sizeof(struct tar_file));
+	ex->order = (uint32_t *)malloc((count ? count : 1) * sizeof(uint32_t));
+	if (!ex->files || !ex->order)
+		return CPM_ERR_NOMEM;
+
+	for (uint32_t i = 0; i < count; ++i)
+		total += plans[i].block_count;
+	sweep = (struct tar_block *)malloc((total ? total : 1) *
+					   sizeof(struct tar_block));
+	if (!sweep)
+		return CPM_ERR_NOMEM;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		ex->files[i].plan = &plans[i];
+		for (uint32_t j = 0; j < plans[i].block_count; ++j, ++n) {
+			block_to_chs(ex->fs, plans[i].blocks[j], 0, &c, &h, &s);
+			sweep[n].key = ((uint64_t)c << 40) | ((uint64_t)h << 20) |
+				       s;
+			sweep[n].file = i;
+			sweep[n].index = j;
+		}
+	}
+	qsort(sweep, total, sizeof(struct tar_block), block_cmp);
+
+	for (uint32_t i = 0; i < total; ++i)
+		ex->files[sweep[i].file].done_at = i + 1;
+
+	order = (struct tar_order *)malloc((count ? count : 1) *
+					   sizeof(struct tar_order));
+	if (!order) {
+		free(sweep);
+		return CPM_ERR_NOMEM;
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		order[i].done_at = ex->files[i].done_at;
+		order[i].file = i;
+	}
+	qsort(order, count, sizeof(struct tar_order), order_cmp);
+	for (uint32_t i = 0; i < count; ++i)
+		ex->order[i] = order[i].file;
+	free(order);
+
+	/* Empty files are written first */
+	ret = tar_emit(ex, 0, count);
+	for (uint32_t i = 0; i < total && !ret; ++i) {
+		ret = read_block(ex->fs,
+				 ex->iov,
+				 plans[sweep[i].file].blocks[sweep[i].index],
+				 ex->block,
+				 0,
+				 block_len(ex->fs,
+					   &plans[sweep[i].file],
+					   sweep[i].index));
+		if (!ret)
+			ret = tar_take(ex, &sweep[i]);
+		if (!ret)
+			ret = tar_emit(ex, i + 1, count);
+	}
+
+	/* End of archive */
+	memset(ex->record, 0, TAR_RECORD);
+	for (int i = 0; i < 2 && !ret; ++i)
+		ret = ex->sink(ex->userdata, ex->record, TAR_RECORD);
+
+	free(sweep);
+	return ret;
+}
+
+enum cpm_fs_status cpm_fs_export_tar(struct cpm_fs *fs,
+				     size_t max_buffer,
+				     cpm_fs_stream_cb sink,
+				     void *userdata)
+{
+	struct tar_export ex;
+	struct plan_file *plans = NULL;
+	uint32_t count = 0;
+	int ret;
+
+	if (!fs || !sink)
+		return CPM_ERR_INVALID_ARG;
+
+	memset(&ex, 0, sizeof(ex));
+	ex.fs = fs;
+	ex.sink = sink;
+	ex.userdata = userdata;
+	ex.max_buffer = max_buffer ? max_buffer : CPM_FS_DEFAULT_TAR_BUFFER;
+	ex.iov = (struct cpm_fs_sector_io *)calloc(
+		fs->iov_cap, sizeof(struct cpm_fs_sector_io));
+	ex.block = (uint8_t *)malloc(fs->attr.block_size);
+	if (!ex.iov || !ex.block) {
+		ret = CPM_ERR_NOMEM;
+		goto end;
+	}
+
+	fs_lock_shared(fs);
+	ret = plan_files(fs, &plans, &count);
+	if (!ret)
+		ret = export_tar(&ex, plans, count);
+	fs_unlock(fs);
+
+	for (uint32_t i = 0; ex.files && i < count; ++i) {
+		if (!ex.files[i].bufs)
+			continue;
+		for (uint32_t j = 0; j < plans[i].block_count; ++j)
+			free(ex.files[i].bufs[j]);
+		free(ex.files[i].bufs);
+	}
+	free(ex.files);
+	free(ex.order);
+	free_plan(plans, count);
+end:
+	free(ex.iov);
+	free(ex.block);
+	return (enum cpm_fs_status)ret;
+}
@@ -9,10 +9,17 @@ enum cpm_fs_status cpm_fs_init_crawler(struct cpm_fs *fs,
 				       struct cpm_fs_crawler **out_crawler)
 {
 	struct cpm_fs_crawler *res;
+	int ret;
 
 	if (!fs || !out_crawler)
 		return CPM_ERR_INVALID_ARG;
 
+	fs_lock(fs);
+	ret = ensure_checked(fs);
+	fs_unlock(fs);
+	if (ret)
+		return ret;
+
 	res = calloc(sizeof(struct cpm_fs_crawler), 1);
 	if (!res)
 		return CPM_ERR_NOMEM;
@@ -27,40 +34,55 @@ enum cpm_fs_status cpm_fs_init_crawler(struct cpm_fs *fs,
 	return CPM_SUCCESS;
 }
 
-enum cpm_fs_status cpm_fs_get_unused_blocks(struct cpm_fs *fs,
-					    struct cpm_fs_crawler *crawler,
-					    uint8_t **out_buf)
+static int next_unused_block(struct cpm_fs *fs,
+			     struct cpm_fs_crawler *crawler,
+			     uint8_t **out_buf)
 {
-	uint32_t max_blocks = fs->disk_size / fs->attr.block_size;
-	uint32_t c, h, s;
+	struct cpm_fs_sector_io *io = fs->iov;
+	uint32_t i;
 	int ret;
 
-	if (!fs || !crawler || !out_buf)
-		return CPM_ERR_INVALID_ARG;
-
-	for (uint32_t i = crawler->block; i < max_blocks; ++i) {
-		if (av_get(fs, i))
-			continue;
-
+	i = av_find_free(fs, crawler->block);
+	if (i != CPM_NO_ENTRY) {
+		/* Unused blocks are not worth caching */
 		for (uint32_t j = 0;
 		     j < fs->attr.block_size / fs->attr.sector_size;
 		     ++j) {
-			block_to_chs(
-				fs, i, j * fs->attr.sector_size, &c, &h, &s);
-			ret = fs->read_sector(fs->userdata, c, h, s, fs->cache);
-			if (ret != 0)
-				return CPM_ERR_SECTOR_READ;
-
-			memcpy(crawler->buf + j * fs->attr.sector_size,
-			       fs->cache,
-			       fs->attr.sector_size);
+			block_to_chs(fs,
+				     i,
+				     j * fs->attr.sector_size,
+				     &io[j].cylinder,
+				     &io[j].head,
+				     &io[j].sector);
+			io[j].buf = crawler->buf + j * fs->attr.sector_size;
 		}
+		ret = disk_read(fs,
+				io,
+				fs->attr.block_size / fs->attr.sector_size);
+		if (ret != 0)
+			return ret;
 		crawler->block = i + 1;
 		*out_buf = crawler->buf;
-		return CPM_SUCCESS;
+		return 0;
 	}
 	*out_buf = NULL;
-	return CPM_SUCCESS;
+	return 0;
+}
+
+enum cpm_fs_status cpm_fs_get_unused_blocks(struct cpm_fs *fs,
+					    struct cpm_fs_crawler *crawler,
+					    uint8_t **out_buf)
+{
+	int ret;
+
+	if (!fs || !crawler || !out_buf)
+		return CPM_ERR_INVALID_ARG;
+
+	/* fs->iov is shared */
+	fs_lock(fs);
+	ret = next_unused_block(fs, crawler, out_buf);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
 }
 
 enum cpm_fs_status cpm_fs_destroy_crawler(struct cpm_fs *fs,
@@ -73,47 +95,41 @@ enum cpm_fs_status cpm_fs_destroy_crawler(struct cpm_fs *fs,
 	return CPM_SUCCESS;
 }
 
-static int get_last_block(struct cpm_fs *fs, cpm_entry *entry)
+/* Fill sectors from first to the end of the block with 0xE5 */
+static int wipe_block(struct cpm_fs *fs, uint32_t block, uint32_t first)
 {
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8) {
-		for (int i = 15; i >= 0; --i)
-			if (entry->block_ptr[i] > 0)
-				return entry->block_ptr[i];
-	} else {
-		for (int i = 7; i >= 0; --i)
-			if (entry->block_ptr_w[i] > 0)
-				return entry->block_ptr_w[i];
+	uint32_t sectors_per_block = fs->attr.block_size / fs->attr.sector_size;
+	struct cpm_fs_sector_io *io = fs->iov;
+	uint32_t n = 0;
+
+	for (uint32_t j = first; j < sectors_per_block; ++j, ++n) {
+		block_to_chs(fs,
+			     block,
+			     j * fs->attr.sector_size,
+			     &io[n].cylinder,
+			     &io[n].head,
+			     &io[n].sector);
+		io[n].buf = fs->scratch;
 	}
-	return 0;
+	return disk_write(fs, io, n);
 }
 
-enum cpm_fs_status cpm_fs_wipe_unused_sectors(struct cpm_fs *fs)
+static int wipe_unused(struct cpm_fs *fs)
 {
-	uint32_t max_blocks = fs->disk_size / fs->attr.block_size;
-	uint32_t sectors_per_block = fs->attr.block_size / fs->attr.sector_size;
-	size_t used_sectors;
-	uint32_t c, h, s;
+	uint32_t used;
 	int block;
 	int ret;
 
-	if (!fs)
-		return CPM_ERR_INVALID_ARG;
+	if ((ret = ensure_checked(fs)))
+		return ret;
 
-	memset(fs->cache, 0xE5, fs->attr.sector_size);
+	memset(fs->scratch, 0xE5, fs->attr.sector_size);
 
 	/* Check for unused blocks and wipe their contents */
-	for (uint32_t i = 0; i < max_blocks; ++i) {
-		if (av_get(fs, i))
-			continue;
-
-		for (uint32_t j = 0; j < sectors_per_block; ++j) {
-			block_to_chs(
-				fs, i, j * fs->attr.sector_size, &c, &h, &s);
-			ret = fs->write_sector(
-				fs->userdata, c, h, s, fs->cache);
-			if (ret != 0)
-				return CPM_ERR_SECTOR_WRITE;
-		}
+	for (uint32_t i = av_find_free(fs, 0); i != CPM_NO_ENTRY;
+	     i = av_find_free(fs, i + 1)) {
+		if ((ret = wipe_block(fs, i, 0)))
+			return ret;
 	}
 
 	/* Wipe unused sectors in the last block of files */
@@ -124,28 +140,32 @@ enum cpm_fs_status cpm_fs_wipe_unused_sectors(struct cpm_fs *fs)
 		    entry->rc == 0x80)
 			continue;
 
-		block = get_last_block(fs, entry);
+		block = fs->blk->last(entry);
 		if (block == 0)
 			continue;
 
-		used_sectors = (entry->rc * 0x80) % fs->attr.block_size;
-		if (used_sectors == 0)
+		/* Bytes used in the last block, rounded up to sectors */
+		used = (entry->rc * 0x80) % fs->attr.block_size;
+		if (used == 0)
 			continue;
 
-		used_sectors = (used_sectors + 1) / fs->attr.sector_size;
-		for (size_t j = used_sectors; j < sectors_per_block; ++j) {
-			block_to_chs(fs,
-				     block,
-				     j * fs->attr.sector_size,
-				     &c,
-				     &h,
-				     &s);
-			ret = fs->write_sector(
-				fs->userdata, c, h, s, fs->cache);
-			if (ret != 0)
-				return CPM_ERR_SECTOR_WRITE;
-		}
+		used = (used + fs->attr.sector_size - 1) / fs->attr.sector_size;
+		if ((ret = wipe_block(fs, (uint32_t)block, used)))
+			return ret;
 	}
 
-	return CPM_SUCCESS;
+	return 0;
+}
+
+enum cpm_fs_status cpm_fs_wipe_unused_sectors(struct cpm_fs *fs)
+{
+	int ret;
+
+	if (!fs)
+		return CPM_ERR_INVALID_ARG;
+
+	fs_lock(fs);
+	ret = wipe_unused(fs);
+	fs_unlock(fs);
+	return (enum cpm_fs_status)ret;
 }
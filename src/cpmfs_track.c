@@ -0,0 +1,166 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpmfs_internal.h"
+
+static uint32_t track_size(struct cpm_fs *fs)
+{
+	return fs->attr.sector_count * fs->attr.sector_size;
+}
+
+static int track_writeback(struct cpm_fs *fs, struct cpm_track *track)
+{
+	if (!track->dirty)
+		return 0;
+	if (fs->io.write_track(fs->userdata,
+			       track->key / fs->attr.heads,
+			       track->key % fs->attr.heads,
+			       track->data))
+		return CPM_ERR_SECTOR_WRITE;
+	track->dirty = false;
+	return 0;
+}
+
+/* Return a cached track, reading it if needed. Evicting the least recently
+ * used track writes it back first if it was modified. */
+static int
+track_get(struct cpm_fs *fs, uint32_t c, uint32_t h, struct cpm_track **out)
+{
+	struct cpm_track_cache *tc = &fs->tracks;
+	struct cpm_track *victim = NULL;
+	uint32_t key = c * fs->attr.heads + h;
+	int ret;
+
+	for (uint32_t i = 0; i < tc->count; ++i) {
+		struct cpm_track *t = &tc->tracks[i];
+		if (t->key == key) {
+			t->last_use = ++tc->clock;
+			*out = t;
+			return 0;
+		}
+		if (!victim || t->key == CPM_NO_ENTRY ||
+		    (victim->key != CPM_NO_ENTRY &&
+		     t->last_use < victim->last_use))
+			victim = t;
+	}
+
+	if (victim->key != CPM_NO_ENTRY && (ret = track_writeback(fs, victim)))
+		return ret;
+
+	victim->key = CPM_NO_ENTRY;
+	if (fs->io.read_track(fs->userdata, c, h, victim->data))
+		return CPM_ERR_SECTOR_READ;
+	victim->key = key;
+	victim->last_use = ++tc->clock;
+	*out = victim;
+	return 0;
+}
+
+int track_init(struct cpm_fs *fs)
+{
+	struct cpm_track_cache *tc = &fs->tracks;
+
+	if (!fs->io.read_track)
+		return 0;
+
+	tc->count = fs->attr.cache_tracks;
+	if (!tc->count)
+		tc->count = CPM_FS_DEFAULT_CACHE_TRACKS;
+
+	tc->tracks = (struct cpm_track *)calloc(tc->count,
+						sizeof(struct cpm_track));
+	tc->data = (uint8_t *)malloc((size_t)tc->count * track_size(fs));
+	if (!tc->tracks || !tc->data)
+		return CPM_ERR_NOMEM;
+	if (pthread_mutex_init(&tc->lock, NULL))
+		return CPM_ERR_NOMEM;
+	tc->lock_init = true;
+
+	for (uint32_t i = 0; i < tc->count; ++i) {
+		tc->tracks[i].key = CPM_NO_ENTRY;
+		tc->tracks[i].data = tc->data + (size_t)i * track_size(fs);
+	}
+	return 0;
+}
+
+void track_free(struct cpm_fs *fs)
+{
+	if (fs->tracks.lock_init)
+		pthread_mutex_destroy(&fs->tracks.lock);
+	free(fs->tracks.tracks);
+	free(fs->tracks.data);
+}
+
+int track_read(struct cpm_fs *fs, struct cpm_fs_sector_io *io, uint32_t count)
+{
+	struct cpm_track *track;
+	int ret = 0;
+
+	/* Concurrent readers share the cache */
+	pthread_mutex_lock(&fs->tracks.lock);
+	for (uint32_t i = 0; i < count && !ret; ++i) {
+		if ((ret = track_get(fs, io[i].cylinder, io[i].head, &track)))
+			break;
+		memcpy(io[i].buf,
+		       track->data + io[i].sector * fs->attr.sector_size,
+		       fs->attr.sector_size);
+	}
+	pthread_mutex_unlock(&fs->tracks.lock);
+	return ret;
+}
+
+int track_write(struct cpm_fs *fs,
+		const struct cpm_fs_sector_io *io,
+		uint32_t count)
+{
+	struct cpm_track *track;
+	int ret;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		if ((ret = track_get(fs, io[i].cylinder, io[i].head, &track)))
+			return ret;
+		memcpy(track->data + io[i].sector * fs->attr.sector_size,
+		       io[i].buf,
+		       fs->attr.sector_size);
+		track->dirty = true;
+	}
+	return 0;
+}
+
+void track_update(struct cpm_fs *fs,
+		  const struct cpm_fs_sector_io *io,
+		  uint32_t count)
+{
+	struct cpm_track_cache *tc = &fs->tracks;
+	uint32_t key;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		key = io[i].cylinder * fs->attr.heads + io[i].head;
+		for (uint32_t j = 0; j < tc->count; ++j) {
+			if (tc->tracks[j].key != key)
+				continue;
+			memcpy(tc->tracks[j].data +
+				       io[i].sector * fs->attr.sector_size,
+			       io[i].buf,
+			       fs->attr.sector_size);
+			break;
+		}
+	}
+}
+
+int track_flush(struct cpm_fs *fs)
+{
+	struct cpm_track_cache *tc = &fs->tracks;
+	int ret;
+
+	for (uint32_t i = 0; i < tc->count; ++i) {
+		if (tc->tracks[i].key == CPM_NO_ENTRY)
+			continue;
+		if ((ret = track_writeback(fs, &tc->tracks[i])))
+			return ret;
+	}
+	return 0;
+}
@@ -0,0 +1,346 @@
+/* Copyright (c) 2025 Arthur DAUZAT
+ * SPDX-License-Identifier: BSD-3-Clause */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpmfs_internal.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CPM_HAVE_URING 1
+#endif
+#endif
+
+#ifdef CPM_HAVE_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Minimal io_uring wrapper, without liburing. Several threads can have
+ * requests in flight at the same time: each one submits its own, and
+ * whoever waits in the kernel reaps completions for everyone. */
+struct cpm_uring {
+	int fd;
+	uint32_t depth; /* Max requests in flight */
+	uint32_t in_flight;
+
+	uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* Completions were reaped */
+	bool reaping; /* A thread waits for completions in the kernel */
+	/* io_uring_enter failed, nothing is submitted anymore. Requests
+	 * already submitted are still reaped. */
+	bool broken;
+};
+
+/* Requests of one uring_rw call */
+struct uring_batch {
+	uint32_t remaining;
+	uint32_t len;
+	int error;
+};
+
+/* Submit every queued request, and wait for min_complete completions */
+static int ring_enter(struct cpm_uring *ring,
+		      uint32_t to_submit,
+		      uint32_t min_complete)
+{
+	int ret;
+
+	ret = (int)syscall(__NR_io_uring_enter,
+			   ring->fd,
+			   to_submit,
+			   min_complete,
+			   min_complete ? IORING_ENTER_GETEVENTS : 0,
+			   NULL,
+			   0);
+	/* Temporary failures, queued requests are submitted next time */
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+		return 0;
+	return ret;
+}
+
+/* Requests queued but not submitted yet */
+static uint32_t sq_pending(struct cpm_uring *ring)
+{
+	return *ring->sq_tail -
+	       __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct cpm_uring *uring_open(uint32_t depth)
+{
+	struct io_uring_params p;
+	struct cpm_uring *ring;
+	uint8_t *sq, *cq;
+
+	ring = (struct cpm_uring *)calloc(sizeof(struct cpm_uring), 1);
+	if (!ring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	ring->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL,
+			     ring->sq_ring_size,
+			     PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE,
+			     ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL,
+				     ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE,
+				     ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto error;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL,
+						 ring->sqes_size,
+						 PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_POPULATE,
+						 ring->fd,
+						 IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+
+	sq = (uint8_t *)ring->sq_ring;
+	ring->sq_head = (uint32_t *)(sq + p.sq_off.head);
+	ring->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+	ring->sq_mask = (uint32_t *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (uint32_t *)(sq + p.sq_off.array);
+
+	cq = (uint8_t *)ring->cq_ring;
+	ring->cq_head = (uint32_t *)(cq + p.cq_off.head);
+	ring->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+	ring->cq_mask = (uint32_t *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* The completion queue can't overflow */
+	ring->depth = p.sq_entries;
+	if (ring->depth > p.cq_entries)
+		ring->depth = p.cq_entries;
+
+	if (pthread_mutex_init(&ring->lock, NULL))
+		goto error;
+	if (pthread_cond_init(&ring->cond, NULL)) {
+		pthread_mutex_destroy(&ring->lock);
+		goto error;
+	}
+	return ring;
+
+error:
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+	    ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+	return NULL;
+}
+
+void uring_close(struct cpm_uring *ring)
+{
+	if (!ring)
+		return;
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->cond);
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+/* Queue one request, the ring must have room for it */
+static void ring_push(struct cpm_uring *ring,
+		      int fd,
+		      const struct uring_req *req,
+		      struct uring_batch *batch,
+		      bool write)
+{
+	uint32_t tail = *ring->sq_tail;
+	uint32_t idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)req->buf;
+	sqe->len = batch->len;
+	sqe->off = req->offset;
+	sqe->user_data = (uint64_t)(uintptr_t)batch;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Process every available completion, with the lock held */
+static void ring_reap(struct cpm_uring *ring)
+{
+	uint32_t head = *ring->cq_head;
+	struct io_uring_cqe *cqe;
+	struct uring_batch *batch;
+	bool reaped = false;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		batch = (struct uring_batch *)(uintptr_t)cqe->user_data;
+		/* Short transfers mean the sector is outside the image */
+		if (cqe->res != (int32_t)batch->len)
+			batch->error = 1;
+		batch->remaining--;
+		ring->in_flight--;
+		head++;
+		reaped = true;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	if (reaped)
+		pthread_cond_broadcast(&ring->cond);
+}
+
+/* Fail the requests queued but never submitted once the ring is broken,
+ * they would never complete. Only when no thread is in the kernel, as it
+ * could be submitting them. */
+static void ring_cancel(struct cpm_uring *ring)
+{
+	uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe;
+	struct uring_batch *batch;
+
+	if (head == tail)
+		return;
+
+	for (; head != tail; ++head) {
+		sqe = &ring->sqes[ring->sq_array[head & *ring->sq_mask]];
+		batch = (struct uring_batch *)(uintptr_t)sqe->user_data;
+		batch->error = 1;
+		batch->remaining--;
+		ring->in_flight--;
+	}
+	__atomic_store_n(ring->sq_tail,
+			 __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&ring->cond);
+}
+
+int uring_rw(struct cpm_uring *ring,
+	     int fd,
+	     const struct uring_req *reqs,
+	     uint32_t count,
+	     uint32_t len,
+	     bool write)
+{
+	struct uring_batch batch = { 0, len, 0 };
+	uint32_t next = 0, queued;
+	uint32_t pending;
+	int ret;
+
+	pthread_mutex_lock(&ring->lock);
+	/* Even on failure, buffers are only given back once the kernel is done
+	 * with them */
+	while (next < count || batch.remaining) {
+		if (ring->broken)
+			batch.error = 1;
+		/* Stop at the first failed request */
+		if (batch.error)
+			next = count;
+
+		/* Keep up to depth requests in flight, with the others */
+		for (queued = 0; next < count && ring->in_flight < ring->depth;
+		     ++next, ++queued) {
+			ring_push(ring, fd, &reqs[next], &batch, write);
+			batch.remaining++;
+			ring->in_flight++;
+		}
+		if (queued && ring_enter(ring, sq_pending(ring), 0) < 0)
+			ring->broken = true;
+		if (ring->broken && !ring->reaping)
+			ring_cancel(ring);
+
+		ring_reap(ring);
+		/* Otherwise the ring is full of other threads' requests */
+		if (!batch.remaining && next == count)
+			continue;
+
+		if (ring->reaping) {
+			pthread_cond_wait(&ring->cond, &ring->lock);
+			continue;
+		}
+
+		/* Wait in the kernel for everyone */
+		ring->reaping = true;
+		pending = ring->broken ? 0 : sq_pending(ring);
+		pthread_mutex_unlock(&ring->lock);
+		ret = ring_enter(ring, pending, 1);
+		pthread_mutex_lock(&ring->lock);
+		ring->reaping = false;
+		if (ret < 0)
+			ring->broken = true;
+		ring_reap(ring);
+		/* Let a waiting thread take over */
+		pthread_cond_broadcast(&ring->cond);
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return batch.error ? -1 : 0;
+}
+
+#else
+
+struct cpm_uring *uring_open(uint32_t __attribute__((unused)) depth)
+{
+	return NULL;
+}
+
+void uring_close(struct cpm_uring __attribute__((unused)) * ring)
+{
+}
+
+int uring_rw(struct cpm_uring __attribute__((unused)) * ring,
+	     int __attribute__((unused)) fd,
+	     const struct uring_req __attribute__((unused)) * reqs,
+	     uint32_t __attribute__((unused)) count,
+	     uint32_t __attribute__((unused)) len,
+	     bool __attribute__((unused)) write)
+{
+	return -1;
+}
+
+#endif
@@ -34,12 +34,49 @@ bool is_allowed_char(char c)
 	return 1;
 }
 
-int av_build(struct cpm_fs *fs)
+static uint32_t block_cylinder(struct cpm_fs *fs,
+			       uint32_t block,
+			       uint32_t block_offset)
+{
+	uint32_t c, h, s;
+
+	block_to_chs(fs, block, block_offset, &c, &h, &s);
+	return c;
+}
+
+static uint32_t cylinder_distance(uint32_t a, uint32_t b)
+{
+	return (a > b) ? a - b : b - a;
+}
+
+/* Find blocks which aren't followed by a physically close one, typically
+ * at the end of a side for CPM_FILL_HCS. */
+static int av_build_breaks(struct cpm_fs *fs)
+{
+	uint32_t end, start;
+
+	fs->av_breaks = (uint64_t *)calloc(BITMAP_WORDS(fs->av_blocks),
+					   sizeof(uint64_t));
+	if (!fs->av_breaks)
+		return CPM_ERR_NOMEM;
+
+	for (uint32_t i = 0; i + 1 < fs->av_blocks; ++i) {
+		end = block_cylinder(fs, i, fs->attr.block_size - 1);
+		start = block_cylinder(fs, i + 1, 0);
+		if (cylinder_distance(end, start) > 1)
+			bitmap_set(fs->av_breaks, i);
+	}
+	return 0;
+}
+
+int av_init(struct cpm_fs *fs)
 {
 	uint32_t dir_blocks;
 
-	fs->av = (uint8_t *)calloc(
-		(fs->disk_size / fs->attr.block_size) / 8 + 1, 1);
+	fs->av_blocks = fs->disk_size / fs->attr.block_size;
+	fs->av_free = fs->av_blocks;
+	fs->av = (uint64_t *)calloc(BITMAP_WORDS(fs->av_blocks),
+				    sizeof(uint64_t));
 	if (!fs->av)
 		return CPM_ERR_NOMEM;
 
@@ -51,21 +88,9 @@ int av_build(struct cpm_fs *fs)
 	for (uint32_t i = 0; i < dir_blocks; ++i)
 		av_set(fs, i);
 
-	/* Mark blocks referenced by valid directory entries */
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		cpm_entry *entry = &fs->superblock.entries[i];
-		if (!cpm_entry_is_valid(entry))
-			continue;
-
-		if (fs->block_addressing == CPM_BLOCK_ADDR_8) {
-			for (int j = 0; j < 16; ++j)
-				if (entry->block_ptr[j] > 0)
-					av_set(fs, entry->block_ptr[j]);
-		} else {
-			for (int j = 0; j < 8; ++j)
-				if (entry->block_ptr_w[j])
-					av_set(fs, entry->block_ptr_w[j]);
-		}
+	if (fs->attr.alloc_policy == CPM_ALLOC_CONTIGUOUS) {
+		if (av_build_breaks(fs))
+			return CPM_ERR_NOMEM;
 	}
 
 	return CPM_SUCCESS;
@@ -73,46 +98,102 @@ int av_build(struct cpm_fs *fs)
 
 void av_set(struct cpm_fs *fs, int block_index)
 {
-	fs->av[block_index / 8] |= (1u << (block_index % 8));
+	/* Out of range blocks are reported by check_superblock */
+	if ((uint32_t)block_index >= fs->av_blocks ||
+	    bitmap_get(fs->av, (uint32_t)block_index))
+		return;
+	bitmap_set(fs->av, (uint32_t)block_index);
+	fs->av_free--;
 }
 
 void av_unset(struct cpm_fs *fs, int block_index)
 {
-	fs->av[block_index / 8] &= (~(1u << (block_index % 8)));
+	if ((uint32_t)block_index >= fs->av_blocks ||
+	    !bitmap_get(fs->av, (uint32_t)block_index))
+		return;
+	bitmap_clear(fs->av, (uint32_t)block_index);
+	fs->av_free++;
 }
 
 int av_get(struct cpm_fs *fs, int block_index)
 {
-	return fs->av[block_index / 8] & (1u << (block_index % 8));
+	if ((uint32_t)block_index >= fs->av_blocks)
+		return 1;
+	return bitmap_get(fs->av, (uint32_t)block_index);
 }
 
-/* Available disk size for files and superblock, in bytes */
-uint32_t get_disk_size(struct cpm_fs *fs)
+uint32_t av_find_free(struct cpm_fs *fs, uint32_t start)
 {
-	uint32_t cylinders;
+	return bitmap_find_clear(fs->av, fs->av_blocks, start);
+}
 
-	cylinders = fs->attr.cylinders * fs->attr.heads;
-	cylinders -= fs->attr.boot_cylinders;
+void bitmap_set(uint64_t *map, uint32_t bit)
+{
+	map[bit / 64] |= (1ull << (bit % 64));
+}
 
-	return cylinders * fs->attr.sector_size * fs->attr.sector_count;
+void bitmap_clear(uint64_t *map, uint32_t bit)
+{
+	map[bit / 64] &= ~(1ull << (bit % 64));
 }
 
-/* Return 0 if identical */
-static int compare_name(cpm_entry *entry, const char *file)
+bool bitmap_get(const uint64_t *map, uint32_t bit)
 {
-	for (size_t i = 0; i < 8; ++i)
-		if ((entry->file[i] & 0x7F) != file[i])
-			return -1;
-	return 0;
+	return (map[bit / 64] >> (bit % 64)) & 1;
 }
 
-/* Return 0 if identical */
-static int compare_ext(cpm_entry *entry, const char *extension)
+static uint32_t
+bitmap_find(const uint64_t *map, uint32_t bits, uint32_t start, uint64_t flip)
 {
-	for (size_t i = 0; i < 3; ++i)
-		if ((entry->extension[i] & 0x7F) != extension[i])
-			return -1;
-	return 0;
+	uint32_t word = start / 64;
+	uint64_t val;
+
+	if (start >= bits)
+		return CPM_NO_ENTRY;
+
+	/* Ignore bits below start in the first word */
+	val = (map[word] ^ flip) & (~0ull << (start % 64));
+	while (!val) {
+		if (++word >= BITMAP_WORDS(bits))
+			return CPM_NO_ENTRY;
+		val = map[word] ^ flip;
+	}
+
+	start = word * 64 + (uint32_t)__builtin_ctzll(val);
+	return (start < bits) ? start : CPM_NO_ENTRY;
+}
+
+uint32_t bitmap_find_set(const uint64_t *map, uint32_t bits, uint32_t start)
+{
+	return bitmap_find(map, bits, start, 0);
+}
+
+uint32_t bitmap_find_clear(const uint64_t *map, uint32_t bits, uint32_t start)
+{
+	return bitmap_find(map, bits, start, ~0ull);
+}
+
+uint32_t bitmap_count(const uint64_t *map, uint32_t bits)
+{
+	uint32_t count = 0;
+
+	for (uint32_t i = 0; i < bits / 64; ++i)
+		count += (uint32_t)__builtin_popcountll(map[i]);
+	if (bits % 64)
+		count += (uint32_t)__builtin_popcountll(
+			map[bits / 64] & ((1ull << (bits % 64)) - 1));
+	return count;
+}
+
+/* Available disk size for files and superblock, in bytes */
+uint32_t get_disk_size(struct cpm_fs *fs)
+{
+	uint32_t cylinders;
+
+	cylinders = fs->attr.cylinders * fs->attr.heads;
+	cylinders -= fs->attr.boot_cylinders;
+
+	return cylinders * fs->attr.sector_size * fs->attr.sector_count;
 }
 
 /* If the filename is valid, return zero and store pointers & lengths.
@@ -155,16 +236,36 @@ int parse_filename(const char *pathname,
 	return 0;
 }
 
+void entry_get_name(const cpm_entry *entry, char *out)
+{
+	int i;
+
+	/* Copy file name without status flags */
+	for (i = 0; i < 8; ++i)
+		out[i] = entry->file[i] & 0x7f;
+	for (i = 7; i >= 0 && out[i] == 0x20; --i)
+		;
+	out += i + 1;
+	if ((entry->extension[0] & 0x7f) != 0x20) {
+		*(out++) = '.';
+		i = -1;
+		while (++i < 3 && (entry->extension[i] & 0x7f) != 0x20)
+			*(out++) = entry->extension[i] & 0x7f;
+	}
+	*out = 0;
+}
+
 /* Returns first entry for pathname. Extension doesn't include status flags */
 int32_t find_file(struct cpm_fs *fs, const char *pathname, int user)
 {
+	uint8_t key[CPM_KEY_LEN];
 	char input_name[8];
 	char input_ext[8];
 	char *file = NULL;
 	char *dot = NULL;
 	size_t file_len = 0;
 	size_t ext_len = 0;
-	int file_extent = -1;
+	uint32_t id;
 
 	file = (char *)pathname;
 	if (*file == '/')
@@ -194,23 +295,14 @@ int32_t find_file(struct cpm_fs *fs, const char *pathname, int user)
 		memcpy(input_name, file, file_len);
 	}
 
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		cpm_entry *entry = &fs->superblock.entries[i];
+	key[0] = (uint8_t)user;
+	memcpy(key + 1, input_name, 8);
+	memcpy(key + 9, input_ext, 3);
 
-		if (entry->status != user)
-			continue;
-		if (compare_name(entry, input_name) != 0 ||
-		    compare_ext(entry, input_ext) != 0)
-			continue;
-
-		/* Make sure to return the first extent */
-		if (file_extent == -1 ||
-		    extent_nb(entry) <
-			    extent_nb(&fs->superblock.entries[file_extent]))
-			file_extent = i;
-	}
-
-	return file_extent;
+	id = ft_lookup(fs, key);
+	if (id == CPM_NO_ENTRY)
+		return -1;
+	return (int32_t)fs->files.files[id].first;
 }
 
 static void init_entry(cpm_entry *entry)
@@ -222,33 +314,41 @@ static void init_entry(cpm_entry *entry)
 	memset(entry->extension, 0x20, 3);
 }
 
+void mark_entry_dirty(struct cpm_fs *fs, uint32_t entry_idx)
+{
+	uint32_t entries_c = fs->attr.sector_size / sizeof(cpm_entry);
+
+	bitmap_set(fs->superblock.dirty, entry_idx / entries_c);
+}
+
 void wipe_extent(struct cpm_fs *fs, int entry_idx)
 {
 	cpm_entry *entry = &fs->superblock.entries[entry_idx];
 	uint32_t dir_blocks = (fs->attr.max_dir_entries * sizeof(cpm_entry) +
 			       fs->attr.block_size - 1) /
 			      fs->attr.block_size;
+	uint16_t blocks[16];
+	uint8_t count;
 
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8) {
-		for (int i = 0; i < 16; ++i)
-			if (entry->block_ptr[i] > dir_blocks)
-				av_unset(fs, entry->block_ptr[i]);
-	} else {
-		for (int i = 0; i < 8; ++i)
-			if (entry->block_ptr_w[i] > dir_blocks)
-				av_unset(fs, entry->block_ptr_w[i]);
-	}
+	/* Directory blocks are never released */
+	count = entry_get_blocks(fs, entry, blocks);
+	for (uint8_t i = 0; i < count; ++i)
+		if (blocks[i] >= dir_blocks)
+			av_unset(fs, blocks[i]);
 
+	ft_remove_entry(fs, entry_idx);
 	entry->status = 0xE5;
 	memset(entry->block_ptr, 0, 16);
+	mark_entry_dirty(fs, (uint32_t)entry_idx);
 }
 
+/* Return the lowest unused entry, or -1 if the directory is full */
 static int find_free_entry_idx(struct cpm_fs *fs)
 {
-	for (uint32_t i = 0; i < fs->superblock.count; ++i)
-		if (fs->superblock.entries[i].status == 0xE5)
-			return (int)i;
-	return 1;
+	uint32_t idx = bitmap_find_set(
+		fs->files.free_entries, fs->superblock.count, 0);
+
+	return (idx == CPM_NO_ENTRY) ? -1 : (int)idx;
 }
 
 int create_file(struct cpm_fs *fs, const char *pathname, int user)
@@ -273,7 +373,7 @@ int create_file(struct cpm_fs *fs, const char *pathname, int user)
 
 	idx = find_free_entry_idx(fs);
 	if (idx < 0)
-		return CPM_ERR_DISK_FULL;
+		return CPM_ERR_DIRECTORY_FULL;
 
 	/* Flags are not set yet */
 	entry = &fs->superblock.entries[idx];
@@ -282,6 +382,8 @@ int create_file(struct cpm_fs *fs, const char *pathname, int user)
 	memcpy(entry->file, file, file_len);
 	if (ext)
 		memcpy(entry->extension, ext, ext_len);
+	ft_add_entry(fs, idx);
+	mark_entry_dirty(fs, (uint32_t)idx);
 
 	/* Superblock is not written here, this should be done by the caller */
 	return 0;
@@ -295,7 +397,7 @@ int alloc_new_extent(struct cpm_fs *fs, cpm_entry *src_entry)
 
 	extent = find_free_entry_idx(fs);
 	if (extent < 0)
-		return CPM_ERR_DISK_FULL;
+		return -CPM_ERR_DIRECTORY_FULL;
 
 	new_entry = &fs->superblock.entries[extent];
 	number = get_last_extent(fs, src_entry) + 1;
@@ -306,52 +408,33 @@ int alloc_new_extent(struct cpm_fs *fs, cpm_entry *src_entry)
 	new_entry->bc = 0;
 	new_entry->rc = 0;
 	memset(new_entry->block_ptr, 0, 16);
+	ft_add_entry(fs, extent);
+	mark_entry_dirty(fs, (uint32_t)extent);
 
 	return extent;
 }
 
-/* Return next extent for file. 0 if none found */
 uint32_t get_next_extent(struct cpm_fs *fs, uint32_t extent)
 {
-	cpm_entry *entry = &fs->superblock.entries[extent];
-	cpm_entry *tmp;
-	uint32_t cur_extent = extent_nb(entry);
-	uint32_t tmp_extent;
-	uint32_t res = extent;
-
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		if (i == extent)
-			continue;
-		tmp = &fs->superblock.entries[i];
-		/* Compare status, filename and extension */
-		if (memcmp(tmp, entry, 12) != 0)
-			continue;
-		tmp_extent = extent_nb(tmp);
-		if (tmp_extent <= cur_extent)
-			continue;
-		if (res == extent ||
-		    extent_nb(&fs->superblock.entries[res]) > tmp_extent)
-			res = i;
-	}
-	if (res == extent)
-		return 0;
-	return res;
+	return fs->files.entry_next[extent];
 }
 
-/* For given block and offset, return matching sector */
-void block_to_chs(struct cpm_fs *fs,
-		  uint32_t block,
-		  uint32_t block_offset,
-		  uint32_t *c,
-		  uint32_t *h,
-		  uint32_t *s)
+uint32_t get_first_extent(struct cpm_fs *fs, uint32_t extent)
 {
-	uint32_t offset;
-	uint32_t sector;
+	uint32_t id = fs->files.entry_file[extent];
 
-	offset = block * fs->attr.block_size + block_offset;
-	sector = offset / fs->attr.sector_size;
+	if (id == CPM_NO_ENTRY)
+		return extent;
+	return fs->files.files[id].first;
+}
 
+/* Position of a sector from the start of the file area, without the table */
+static void sector_to_chs(struct cpm_fs *fs,
+			  uint32_t sector,
+			  uint32_t *c,
+			  uint32_t *h,
+			  uint32_t *s)
+{
 	*c = (sector / fs->attr.sector_count) + fs->attr.boot_cylinders;
 	*s = (sector % fs->attr.sector_count);
 
@@ -368,105 +451,142 @@ void block_to_chs(struct cpm_fs *fs,
 		*s = fs->attr.skew_table[*s] - 1;
 }
 
+/* Number of bits needed to store values up to max - 1 */
+static uint8_t bit_width(uint32_t max)
+{
+	uint8_t bits = 0;
+
+	while (bits < 32 && (max - 1) >> bits)
+		bits++;
+	return bits;
+}
+
+/* log2 of value, 0 if it isn't a power of two */
+static uint8_t pow2_shift(uint32_t value)
+{
+	if (value < 2 || (value & (value - 1)))
+		return 0;
+	return (uint8_t)__builtin_ctz(value);
+}
+
+int chs_init(struct cpm_fs *fs)
+{
+	uint32_t c, h, s;
+
+	fs->sector_shift = pow2_shift(fs->attr.sector_size);
+	fs->block_shift = pow2_shift(fs->attr.block_size);
+	fs->chs_head_shift = bit_width(fs->attr.sector_count);
+	fs->chs_cyl_shift = fs->chs_head_shift + bit_width(fs->attr.heads);
+
+	/* Geometry too large to pack, every sector is computed */
+	if (fs->chs_cyl_shift >= 32 ||
+	    fs->chs_cyl_shift + bit_width(fs->attr.cylinders) > 32)
+		return 0;
+
+	fs->chs_count = get_disk_size(fs) / fs->attr.sector_size;
+	fs->chs = (uint32_t *)malloc(
+		(fs->chs_count ? fs->chs_count : 1) * sizeof(uint32_t));
+	if (!fs->chs)
+		return CPM_ERR_NOMEM;
+
+	for (uint32_t i = 0; i < fs->chs_count; ++i) {
+		sector_to_chs(fs, i, &c, &h, &s);
+		fs->chs[i] = (c << fs->chs_cyl_shift) |
+			     (h << fs->chs_head_shift) | s;
+	}
+	return 0;
+}
+
+/* For given block and offset, return matching sector */
+void block_to_chs(struct cpm_fs *fs,
+		  uint32_t block,
+		  uint32_t block_offset,
+		  uint32_t *c,
+		  uint32_t *h,
+		  uint32_t *s)
+{
+	uint32_t offset;
+	uint32_t sector;
+	uint32_t chs;
+
+	if (fs->block_shift)
+		offset = (block << fs->block_shift) + block_offset;
+	else
+		offset = block * fs->attr.block_size + block_offset;
+	if (fs->sector_shift)
+		sector = offset >> fs->sector_shift;
+	else
+		sector = offset / fs->attr.sector_size;
+
+	/* Blocks past the end of the disk still get a position, the
+	 * callbacks report them */
+	if (sector >= fs->chs_count) {
+		sector_to_chs(fs, sector, c, h, s);
+		return;
+	}
+
+	chs = fs->chs[sector];
+	*c = chs >> fs->chs_cyl_shift;
+	*h = (chs >> fs->chs_head_shift) &
+	     ((1u << (fs->chs_cyl_shift - fs->chs_head_shift)) - 1);
+	*s = chs & ((1u << fs->chs_head_shift) - 1);
+}
+
+static struct cpm_file *entry_file(struct cpm_fs *fs, cpm_entry *entry)
+{
+	uint32_t idx = (uint32_t)(entry - fs->superblock.entries);
+	uint32_t id = fs->files.entry_file[idx];
+
+	return (id == CPM_NO_ENTRY) ? NULL : &fs->files.files[id];
+}
+
 /* Return number of the last physical extent associated with given entry */
 uint32_t get_last_extent(struct cpm_fs *fs, cpm_entry *entry)
 {
-	uint32_t extent = 0;
-	cpm_entry *tmp;
+	struct cpm_file *file = entry_file(fs, entry);
 
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		tmp = &fs->superblock.entries[i];
-		if (memcmp(tmp, entry, 12) != 0)
-			continue;
-		if (extent_nb(tmp) > extent)
-			extent = extent_nb(tmp);
-	}
-	return extent;
+	if (!file)
+		return extent_nb(entry);
+	return extent_nb(&fs->superblock.entries[file->last]);
 }
 
 bool entry_is_first_extent(struct cpm_fs *fs, uint32_t extent)
 {
-	cpm_entry *entry = &fs->superblock.entries[extent];
-	cpm_entry *tmp;
+	uint32_t id = fs->files.entry_file[extent];
 
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		if (i == extent)
-			continue;
-		tmp = &fs->superblock.entries[i];
-		/* Compare status, filename and extension */
-		if (memcmp(tmp, entry, 12) != 0)
-			continue;
-		if (extent_nb(tmp) < extent_nb(entry))
-			return false;
-	}
-	return true;
+	return id == CPM_NO_ENTRY || fs->files.files[id].first == extent;
 }
 
 uint32_t get_filesize(struct cpm_fs *fs, cpm_entry *entry)
 {
-	uint32_t last_extent = get_last_extent(fs, entry);
-	uint32_t size = 0;
-	cpm_entry *tmp;
-	uint8_t used_blocks;
-	/* How many blocks per logical extent (16k) */
-	uint8_t block_per_extent = 0x4000 / fs->attr.block_size;
-
-	for (uint32_t i = 0; i < fs->superblock.count; ++i) {
-		tmp = &fs->superblock.entries[i];
-		/* Compare status, filename and extension */
-		if (memcmp(tmp, entry, 12) != 0)
-			continue;
+	struct cpm_file *file = entry_file(fs, entry);
 
-		used_blocks = get_used_blocks(fs, tmp);
-		/* RC specifies the size of the last extent, a disk entry might
-		 * contain multiple logical extents */
-		if (extent_nb(tmp) == last_extent) {
-			/* Size of full logical extents in entry */
-			if (used_blocks > 0)
-				size += 0x4000 *
-					((used_blocks - 1) / block_per_extent);
-			size += 128 * tmp->rc;
-		} else {
-			size += used_blocks * fs->attr.block_size;
-		}
-	}
-	return size;
+	return file ? file->size : 0;
 }
 
 /* Block utils */
 
 bool is_last_block(struct cpm_fs *fs, cpm_entry *entry, uint16_t idx)
 {
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8) {
-		if (idx == 15 || entry->block_ptr[idx + 1] == 0)
-			return true;
-	} else {
-		if (idx == 7 || entry->block_ptr_w[idx + 1] == 0)
-			return true;
-	}
-	return false;
+	return fs->blk->is_last(entry, idx);
 }
 
 uint8_t get_used_blocks(struct cpm_fs *fs, cpm_entry *entry)
 {
-	uint8_t count = 0;
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8) {
-		for (int i = 0; i < 16; ++i) {
-			if (entry->block_ptr[i])
-				count++;
-		}
-	} else {
-		for (int i = 0; i < 8; ++i) {
-			if (entry->block_ptr_w[i])
-				count++;
-		}
-	}
-	return count;
+	return fs->blk->used(entry);
 }
 
 uint8_t max_blocks_per_entry(struct cpm_fs *fs)
 {
-	return (fs->block_addressing == CPM_BLOCK_ADDR_8) ? 16 : 8;
+	return fs->blk->per_entry;
+}
+
+uint8_t entry_get_blocks(struct cpm_fs *fs,
+			 const cpm_entry *entry,
+			 uint16_t *out)
+{
+	fs->blk->decode(entry, out);
+	return fs->blk->per_entry;
 }
 
 void entry_set_block(struct cpm_fs *fs,
@@ -474,21 +594,76 @@ void entry_set_block(struct cpm_fs *fs,
 		     uint8_t idx,
 		     uint16_t block)
 {
-	if (fs->block_addressing == CPM_BLOCK_ADDR_8)
-		entry->block_ptr[idx] = (uint8_t)block;
-	else
-		entry->block_ptr_w[idx] = block;
+	fs->blk->set(entry, idx, block);
+}
+
+/* Start of the longest run of physically contiguous free blocks. On ties,
+ * the one closest to the near block wins. */
+static uint32_t find_largest_free_run(struct cpm_fs *fs, uint16_t near)
+{
+	uint32_t near_cyl = 0;
+	uint32_t best = CPM_NO_ENTRY;
+	uint32_t best_len = 0, best_dist = 0;
+	uint32_t start, end, brk, len, dist;
+
+	if (near)
+		near_cyl = block_cylinder(fs, near, fs->attr.block_size - 1);
+
+	for (start = av_find_free(fs, 1); start != CPM_NO_ENTRY;
+	     start = av_find_free(fs, end)) {
+		end = bitmap_find_set(fs->av, fs->av_blocks, start);
+		if (end == CPM_NO_ENTRY)
+			end = fs->av_blocks;
+		brk = bitmap_find_set(fs->av_breaks, fs->av_blocks, start);
+		if (brk != CPM_NO_ENTRY && brk + 1 < end)
+			end = brk + 1;
+
+		len = end - start;
+		if (len < best_len)
+			continue;
+		dist = cylinder_distance(near_cyl,
+					 block_cylinder(fs, start, 0));
+		if (len > best_len || (near && dist < best_dist)) {
+			best = start;
+			best_len = len;
+			best_dist = dist;
+		}
+	}
+	return best;
 }
 
-/* Return the number of the first free (unallocated) block, or 0 on failure. */
 /* Block 0 is always used by the superblock so we can use it for error */
-uint16_t find_free_block(struct cpm_fs *fs)
+uint16_t find_free_block(struct cpm_fs *fs, uint16_t prev)
 {
-	uint16_t total_blocks = fs->disk_size / fs->attr.block_size;
+	uint32_t block;
+
+	if (!fs->av_free)
+		return 0; /* Disk full */
+
+	if (fs->attr.alloc_policy == CPM_ALLOC_CONTIGUOUS) {
+		/* Right after the previous block of the file */
+		if (prev && prev + 1u < fs->av_blocks && !av_get(fs, prev + 1) &&
+		    !bitmap_get(fs->av_breaks, prev))
+			return prev + 1;
+		block = find_largest_free_run(fs, prev);
+	} else {
+		block = av_find_free(fs, 1);
+	}
 
-	for (uint16_t i = 1; i < total_blocks; ++i)
-		if (av_get(fs, i) == 0)
-			return i;
+	return (block == CPM_NO_ENTRY) ? 0 : (uint16_t)block;
+}
 
-	return 0; /* Disk full */
+uint32_t find_free_run(struct cpm_fs *fs, uint32_t start, uint32_t len)
+{
+	uint32_t end;
+
+	for (start = av_find_free(fs, start); start != CPM_NO_ENTRY;
+	     start = av_find_free(fs, end)) {
+		end = bitmap_find_set(fs->av, fs->av_blocks, start);
+		if (end == CPM_NO_ENTRY)
+			end = fs->av_blocks;
+		if (end - start >= len)
+			return start;
+	}
+	return CPM_NO_ENTRY;
 }